@@ -1,20 +1,65 @@
 #include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef struct block {
   size_t size;
   size_t start;
   int used;
+  struct handle *owner;
   struct block *next;
   struct block *prev;
 } block;
 
+#define UNIT 64
+
+#define MAX_ORDERS 32
+
+size_t norders = 10;
+size_t maxsize = 512;
+block *headers[MAX_ORDERS];
+char *arena;
+int verbose = 1;
+
+typedef struct buddy_stats {
+  size_t free_blocks[MAX_ORDERS];
+  size_t requests;
+  size_t failed;
+  size_t frees;
+  size_t splits;
+  size_t merges;
+  size_t batches;
+  size_t compactions;
+  size_t moves;
+  size_t moved_units;
+  size_t recovered_units;
+} buddy_stats;
+
+buddy_stats stats;
+size_t watermark;
+size_t limits[MAX_ORDERS];
+FILE *dump_fp;
+size_t dump_every;
+
+size_t f(size_t n) {
+  size_t ret = 0;
+  while (n >>= 1) {
+    ret++;
+  }
+  return ret;
+}
+
 block *init_block() {
   block *ret = malloc(sizeof(block));
   ret->next = ret;
   ret->prev = ret;
   ret->used = 0;
+  ret->owner = NULL;
   return ret;
 }
 
@@ -25,6 +70,8 @@ void push(block *head, block *b) {
   b->prev = tail;
   b->next = head;
   head->prev = b;
+  if (b->used == 0)
+    stats.free_blocks[f(b->size)]++;
 }
 
 void remove_block(block *b) {
@@ -32,6 +79,15 @@ void remove_block(block *b) {
   b->next->prev = b->prev;
   b->prev->next = b->next;
   b->next = b->prev = b;
+  if (b->used == 0)
+    stats.free_blocks[f(b->size)]--;
+}
+
+void set_used(block *b, int id) {
+  assert(b);
+  if (b->next != b && (b->used == 0) != (id == 0))
+    stats.free_blocks[f(b->size)] += id == 0 ? 1 : -1;
+  b->used = id;
 }
 
 int empty(block *head) {
@@ -39,21 +95,84 @@ int empty(block *head) {
   return head == head->next;
 }
 
-size_t maxsize = 512;
-block *headers[10];
-
-size_t f(size_t n) {
-  size_t ret = 0;
-  while (n >>= 1) {
+size_t order_of(size_t size) {
+  size_t ret = f(size);
+  if (((size_t)1 << ret) < size)
     ret++;
-  }
   return ret;
 }
 
+size_t largest_free() {
+  for (size_t i = norders; i-- > 0;) {
+    if (stats.free_blocks[i])
+      return (size_t)1 << i;
+  }
+  return 0;
+}
+
+size_t free_units() {
+  size_t total = 0;
+  for (size_t i = 0; i < norders; i++) {
+    total += stats.free_blocks[i] << i;
+  }
+  return total;
+}
+
+// External fragmentation: the share of free memory outside the largest
+// free block. 0 means all free space is one block.
+double fragmentation() {
+  size_t total = free_units();
+  if (total == 0)
+    return 0.0;
+  return 1.0 - (double)largest_free() / total;
+}
+
+void buddy_query(buddy_stats *out) {
+  assert(out);
+  *out = stats;
+}
+
+void dump_stats(FILE *fp) {
+  assert(fp);
+  size_t total = free_units(), largest = largest_free();
+  fprintf(fp,
+          "{\"requests\":%lu,\"failed\":%lu,\"frees\":%lu,\"splits\":%lu,"
+          "\"merges\":%lu,\"batches\":%lu,\"free_bytes\":%lu,"
+          "\"largest_free_bytes\":%lu,\"frag\":%.4f,\"compactions\":%lu,"
+          "\"moves\":%lu,\"moved_bytes\":%lu,\"recovered_bytes\":%lu,"
+          "\"free_blocks\":[",
+          stats.requests, stats.failed, stats.frees, stats.splits,
+          stats.merges, stats.batches, total * UNIT, largest * UNIT,
+          fragmentation(), stats.compactions, stats.moves,
+          stats.moved_units * UNIT, stats.recovered_units * UNIT);
+  for (size_t i = 0; i < norders; i++) {
+    fprintf(fp, i ? ",%lu" : "%lu", stats.free_blocks[i]);
+  }
+  fprintf(fp, "]}\n");
+}
+
+void stats_dump(FILE *fp, size_t every) {
+  dump_fp = fp;
+  dump_every = every;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void tick() {
+  if (dump_fp && dump_every &&
+      (stats.requests + stats.frees) % dump_every == 0)
+    dump_stats(dump_fp);
+}
+
 block *split(block *b) {
   assert(b);
   remove_block(b);
   block *ret = init_block();
+  stats.splits++;
   ret->size = b->size / 2;
   ret->start = b->start;
   b->start = b->start + ret->size;
@@ -63,24 +182,9 @@ block *split(block *b) {
   return ret;
 }
 
-void request(size_t size, int id) {
-  assert(id > 0);
-  printf("f = %lu\n", f(size));
-  for (size_t off = f(size); off < 10; off++) {
-    block *head = headers[off];
-    block *p = head->next;
-
-    for (; head != p; p = p->next) {
-      if (p->used == 0) {
-        while (p->size >= size * 2) {
-          p = split(p);
-        }
-        p->used = id;
-        return;
-      }
-    }
-  }
-  printf("request error!\n");
+void *block_addr(block *b) {
+  assert(b);
+  return arena + b->start * UNIT;
 }
 
 int is_buddy(block *a, block *b) {
@@ -98,13 +202,102 @@ block *merge_imp(block *a, block *b) {
     return merge_imp(b, a);
   a->size *= 2;
   free(b);
+  stats.merges++;
   return a;
 }
 
+int cmp_start(const void *a, const void *b) {
+  size_t x = (*(block *const *)a)->start, y = (*(block *const *)b)->start;
+  return x < y ? -1 : x > y;
+}
+
+size_t coalesce(size_t off) {
+  assert(off < norders);
+  size_t n = stats.free_blocks[off], merged = 0;
+  if (off + 1 >= norders || n < 2)
+    return 0;
+  block **v = malloc(n * sizeof(block *));
+  size_t k = 0;
+  block *head = headers[off];
+  for (block *p = head->next; p != head; p = p->next) {
+    if (p->used == 0)
+      v[k++] = p;
+  }
+  assert(k == n);
+  qsort(v, n, sizeof(block *), cmp_start);
+  for (size_t i = 0; i + 1 < n; i++) {
+    if (is_buddy(v[i], v[i + 1])) {
+      remove_block(v[i]);
+      remove_block(v[i + 1]);
+      push(headers[off + 1], merge_imp(v[i], v[i + 1]));
+      merged++;
+      i++;
+    }
+  }
+  free(v);
+  stats.batches++;
+  return merged;
+}
+
+size_t coalesce_all() {
+  size_t merged = 0;
+  for (size_t i = 0; i + 1 < norders; i++) {
+    merged += coalesce(i);
+  }
+  for (size_t i = 0; i < norders; i++) {
+    limits[i] = watermark;
+  }
+  return merged;
+}
+
+void set_lazy(size_t mark) {
+  watermark = mark;
+  coalesce_all();
+}
+
+block *find_free(size_t size, size_t lo, size_t hi) {
+  for (size_t off = order_of(size); off < norders; off++) {
+    block *head = headers[off];
+    block *p = head->next;
+
+    for (; head != p; p = p->next) {
+      if (p->used == 0 && (p->start + p->size <= lo || p->start >= hi)) {
+        while (p->size >= size * 2) {
+          p = split(p);
+        }
+        return p;
+      }
+    }
+  }
+  return NULL;
+}
+
+block *request(size_t size, int id) {
+  assert(id > 0);
+  stats.requests++;
+  if (verbose)
+    printf("f = %lu\n", order_of(size));
+  block *p = find_free(size, 0, 0);
+  if (p) {
+    set_used(p, id);
+    tick();
+    return p;
+  }
+  if (watermark && coalesce_all()) {
+    stats.requests--;
+    return request(size, id);
+  }
+  stats.failed++;
+  tick();
+  if (verbose)
+    printf("request error!\n");
+  return NULL;
+}
+
 void merge(block *b) {
   assert(b && b->next && b->prev);
   size_t off = f(b->size);
-  if (off >= 10)
+  if (off >= norders)
     return;
   block *head = headers[off];
   for (block *p = head->next; p != head; p = p->next) {
@@ -120,55 +313,976 @@ void merge(block *b) {
   }
 }
 
-void freeb(size_t size, int id) {
+void settle(size_t off) {
+  for (size_t i = off; i + 1 < norders; i++) {
+    if (stats.free_blocks[i] <= watermark)
+      limits[i] = watermark;
+    if (stats.free_blocks[i] <= limits[i])
+      break;
+    coalesce(i);
+    limits[i] = stats.free_blocks[i] + watermark;
+  }
+}
+
+void release(block *b) {
+  assert(b && b->used);
+  set_used(b, 0);
+  stats.frees++;
+  if (watermark == 0)
+    merge(b);
+  else
+    settle(f(b->size));
+  tick();
+}
+
+size_t carve(block *b, size_t off, size_t n, int id, block **out) {
+  assert(b && b->used == 0 && f(b->size) > off);
+  size_t piece = (size_t)1 << off;
+  size_t start = b->start, end = b->start + b->size, made = 0;
+  if (n > b->size / piece)
+    n = b->size / piece;
+  remove_block(b);
+  free(b);
+  for (; made < n; made++) {
+    block *p = init_block();
+    p->size = piece;
+    p->start = start + made * piece;
+    p->used = id;
+    push(headers[off], p);
+    out[made] = p;
+  }
+  size_t pos = start + n * piece, pieces = n;
+  while (pos < end) {
+    size_t size = piece;
+    while (pos % (size * 2) == 0 && pos + size * 2 <= end) {
+      size *= 2;
+    }
+    block *p = init_block();
+    p->size = size;
+    p->start = pos;
+    push(headers[f(size)], p);
+    pos += size;
+    pieces++;
+  }
+  stats.splits += pieces - 1;
+  return made;
+}
+
+size_t request_bulk(size_t size, int id, block **out, size_t n) {
+  assert(id > 0 && out);
+  size_t off = order_of(size), got = 0;
+  if (off >= norders)
+    return 0;
+  block *head = headers[off];
+  for (block *p = head->next; p != head && got < n; p = p->next) {
+    if (p->used == 0) {
+      set_used(p, id);
+      out[got++] = p;
+    }
+  }
+  for (size_t i = off + 1; i < norders && got < n;) {
+    block *p = headers[i]->next;
+    while (p != headers[i] && p->used)
+      p = p->next;
+    if (p == headers[i]) {
+      i++;
+      continue;
+    }
+    got += carve(p, off, n - got, id, out + got);
+  }
+  stats.requests += got;
+  if (got < n && watermark && coalesce_all()) {
+    return got + request_bulk(size, id, out + got, n - got);
+  }
+  stats.failed += n - got;
+  tick();
+  return got;
+}
+
+void free_bulk(block **v, size_t n) {
+  assert(v);
+  size_t lo = norders;
+  for (size_t i = 0; i < n; i++) {
+    assert(v[i]->used);
+    set_used(v[i], 0);
+    if (f(v[i]->size) < lo)
+      lo = f(v[i]->size);
+  }
+  stats.frees += n;
+  if (lo == norders)
+    return;
+  for (size_t i = lo; i + 1 < norders; i++) {
+    if (watermark)
+      settle(i);
+    else
+      coalesce(i);
+  }
+  tick();
+}
+
+int freeb(size_t size, int id) {
   assert(id > 0 && size > 0);
+  if (size > maxsize) {
+    if (verbose)
+      printf("freeb error!\n");
+    return 0;
+  }
+  size = (size_t)1 << order_of(size);
   block *head = headers[f(size)];
   for (block *p = head->next; p != head; p = p->next) {
     if (p->used == id && p->size == size) {
-      p->used = 0;
-      merge(p);
-      return;
+      release(p);
+      return 1;
+    }
+  }
+  if (verbose)
+    printf("freeb error!\n");
+  return 0;
+}
+
+block *request_exact(size_t size, int id) {
+  assert(id > 0 && size > 0);
+  block *p = request((size_t)1 << order_of(size), id);
+  if (p == NULL)
+    return NULL;
+  block *first = NULL;
+  size_t need = size;
+  set_used(p, 0);
+  while (need > 0) {
+    if (p->size == need) {
+      set_used(p, id);
+      if (first == NULL)
+        first = p;
+      break;
+    }
+    block *lo = split(p);
+    if (need >= lo->size) {
+      set_used(lo, id);
+      need -= lo->size;
+      if (first == NULL)
+        first = lo;
+    } else {
+      p = lo;
+    }
+  }
+  return first;
+}
+
+// request_exact counts as one request, so its pieces count as one free.
+void freeb_exact(size_t size, int id) {
+  assert(id > 0 && size > 0);
+  // its pieces would fit, but none of them came from this request
+  if (size > maxsize) {
+    if (verbose)
+      printf("freeb error!\n");
+    return;
+  }
+  size_t pieces = 0;
+  for (size_t piece = (size_t)1 << f(size); piece > 0; piece >>= 1) {
+    if (size & piece)
+      pieces += freeb(piece, id);
+  }
+  if (pieces > 1)
+    stats.frees -= pieces - 1;
+}
+
+typedef struct handle {
+  block *b;
+  int pins;
+} handle;
+
+uint64_t compact_budget;
+
+int move_block(block *p, size_t lo, size_t hi) {
+  assert(p && p->used && p->owner && p->owner->pins == 0);
+  block *nb = find_free(p->size, lo, hi);
+  if (nb == NULL)
+    return 0;
+  set_used(nb, p->used);
+  memcpy(block_addr(nb), block_addr(p), p->size * UNIT);
+  nb->owner = p->owner;
+  nb->owner->b = nb;
+  p->owner = NULL;
+  stats.moves++;
+  set_used(p, 0);
+  if (watermark == 0)
+    merge(p);
+  return 1;
+}
+
+size_t compact_step(size_t off, uint64_t budget) {
+  assert(off < norders);
+  if (watermark)
+    coalesce_all();
+  if (largest_free() >= (size_t)1 << off)
+    return 0;
+  uint64_t deadline = now_ns() + budget;
+  size_t nregions = maxsize >> off, before = largest_free();
+  size_t *used = calloc(nregions, sizeof(size_t));
+  for (size_t i = 0; i < norders; i++) {
+    block *head = headers[i];
+    for (block *p = head->next; p != head; p = p->next) {
+      size_t r = p->start >> off;
+      if (p->used == 0 || used[r] == SIZE_MAX)
+        continue;
+      if (i >= off) {
+        // a block this large spans whole regions; none of them can be freed
+        for (size_t k = 0; k < p->size >> off; k++) {
+          used[r + k] = SIZE_MAX;
+        }
+      } else if (p->owner == NULL || p->owner->pins) {
+        used[r] = SIZE_MAX;
+      } else {
+        used[r] += p->size;
+      }
     }
   }
-  printf("freeb error!\n");
+  size_t best = 0;
+  for (size_t r = 1; r < nregions; r++) {
+    if (used[r] < used[best])
+      best = r;
+  }
+  size_t inside = used[best];
+  free(used);
+  if (inside == SIZE_MAX ||
+      inside > free_units() - (((size_t)1 << off) - inside))
+    return 0;
+
+  size_t lo = best << off, hi = lo + ((size_t)1 << off), moved = 0;
+  stats.compactions++;
+  for (size_t i = 0; i < off && now_ns() < deadline; i++) {
+    block *head = headers[i];
+    for (block *p = head->next; p != head && now_ns() < deadline;) {
+      if (p->used == 0 || p->start < lo || p->start >= hi) {
+        p = p->next;
+      } else if (move_block(p, lo, hi)) {
+        moved += (size_t)1 << i;
+        p = head->next;
+      } else {
+        break;
+      }
+    }
+  }
+  if (watermark)
+    coalesce_all();
+  stats.moved_units += moved;
+  if (largest_free() > before)
+    stats.recovered_units += largest_free() - before;
+  return moved;
+}
+
+handle *hrequest(size_t size, int id) {
+  size_t off = order_of(size);
+  if (compact_budget && off < norders) {
+    for (size_t i = 0; i < maxsize >> off; i++) {
+      if (largest_free() >= (size_t)1 << off ||
+          compact_step(off, compact_budget) == 0)
+        break;
+    }
+  }
+  block *b = request(size, id);
+  if (b == NULL)
+    return NULL;
+  handle *h = malloc(sizeof(handle));
+  h->b = b;
+  h->pins = 0;
+  b->owner = h;
+  return h;
+}
+
+void *haddr(handle *h) {
+  assert(h);
+  return block_addr(h->b);
+}
+
+void *hpin(handle *h) {
+  assert(h);
+  h->pins++;
+  return block_addr(h->b);
+}
+
+void hunpin(handle *h) {
+  assert(h && h->pins > 0);
+  h->pins--;
+}
+
+void hfree(handle *h) {
+  assert(h && h->pins == 0);
+  h->b->owner = NULL;
+  release(h->b);
+  free(h);
+}
+
+size_t draw_size(int dist) {
+  switch (dist) {
+  case 0:
+    return 1 + rand() % 64;
+  case 1:
+    return ((size_t)1 << rand() % 7) + rand() % ((size_t)1 << rand() % 7);
+  default:
+    return ((size_t)1 << rand() % 7) + 1;
+  }
+}
+
+void exact_savings() {
+  const char *names[] = {"uniform 1..64", "log-uniform", "pow2 + 1"};
+  int saved = verbose;
+  verbose = 0;
+  srand(1);
+  for (int dist = 0; dist < 3; dist++) {
+    size_t want[2] = {0, 0}, held[2] = {0, 0}, count[2] = {0, 0};
+    for (int trial = 0; trial < 1000; trial++) {
+      size_t sizes[512];
+      size_t n = 0;
+      unsigned seed = rand();
+      for (int exact = 0; exact < 2; exact++) {
+        srand(seed);
+        for (n = 0; n < 512; n++) {
+          sizes[n] = draw_size(dist);
+          block *b = exact ? request_exact(sizes[n], n + 1)
+                           : request(sizes[n], n + 1);
+          if (b == NULL)
+            break;
+          want[exact] += sizes[n];
+          held[exact] += exact ? sizes[n] : (size_t)1 << order_of(sizes[n]);
+        }
+        count[exact] += n;
+        for (size_t i = 0; i < n; i++) {
+          if (exact)
+            freeb_exact(sizes[i], i + 1);
+          else
+            freeb(sizes[i], i + 1);
+        }
+        assert(!empty(headers[norders - 1]) && headers[norders - 1]->next->used == 0);
+      }
+    }
+    for (int exact = 0; exact < 2; exact++) {
+      printf("%-14s %-6s allocs %6lu requested %8lu held %8lu waste %5.1f%%\n",
+             names[dist], exact ? "exact" : "pow2", count[exact], want[exact],
+             held[exact], 100.0 * (held[exact] - want[exact]) / held[exact]);
+    }
+  }
+  verbose = saved;
+}
+
+// Half the arena is one live unmovable block, the other half holds one
+// 1-unit handle per 4-unit region. A step must pick a handle region,
+// not one of the regions the big block covers past its first.
+void compact_check() {
+  int saved = verbose;
+  verbose = 0;
+  block *big = request(maxsize / 2, 1);
+  size_t n = maxsize / 2;
+  handle **hs = malloc(sizeof(handle *) * n);
+  for (size_t i = 0; i < n; i++) {
+    hs[i] = hrequest(1, i + 2);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (hs[i]->b->start % 4) {
+      hfree(hs[i]);
+      hs[i] = NULL;
+    }
+  }
+  size_t before = largest_free();
+  size_t moved = compact_step(2, 1000000000);
+  printf("compact: moved %lu units, largest free %lu -> %lu\n", moved, before,
+         largest_free());
+  assert(moved > 0 && largest_free() >= 4);
+  for (size_t i = 0; i < n; i++) {
+    if (hs[i])
+      hfree(hs[i]);
+  }
+  release(big);
+  free(hs);
+  verbose = saved;
 }
 
-void init() {
-  for (int i = 0; i < 10; i++) {
+// Allocates and frees 10000 4-unit blocks five times in a 2^20-unit arena,
+// first with request()/release() in a loop, then with the bulk calls.
+// Every round must hand the whole arena back as one free block.
+void bulk_bench() {
+  size_t n = 10000, rounds = 5;
+  block **v = malloc(sizeof(block *) * n);
+  uint64_t ns[2] = {0, 0};
+  for (int bulk = 0; bulk < 2; bulk++) {
+    for (size_t round = 0; round < rounds; round++) {
+      uint64_t t0 = now_ns();
+      size_t got = n;
+      if (bulk) {
+        got = request_bulk(4, 1, v, n);
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          v[i] = request(4, 1);
+        }
+      }
+      assert(got == n);
+      if (bulk) {
+        free_bulk(v, n);
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          release(v[i]);
+        }
+      }
+      ns[bulk] += now_ns() - t0;
+      for (size_t i = 0; i + 1 < norders; i++) {
+        assert(stats.free_blocks[i] == 0);
+      }
+      assert(stats.free_blocks[norders - 1] == 1);
+    }
+  }
+  assert(stats.requests == 2 * rounds * n && stats.frees == stats.requests);
+  printf("bulk: %lu x %lu blocks of 4 units, loop %.1f ms, bulk %.1f ms\n",
+         rounds, n, ns[0] / 1e6, ns[1] / 1e6);
+  free(v);
+}
+
+void init(size_t orders) {
+  assert(orders > 0 && orders <= MAX_ORDERS);
+  norders = orders;
+  memset(&stats, 0, sizeof(stats));
+  maxsize = (size_t)1 << (orders - 1);
+  for (size_t i = 0; i < norders; i++) {
     headers[i] = init_block();
   }
   block *b = init_block();
   b->start = 0;
-  b->size = 512;
-  push(headers[9], b);
+  b->size = maxsize;
+  push(headers[norders - 1], b);
+  arena = malloc(maxsize * UNIT);
+}
+
+#define SLAB_UNITS 8
+#define SLAB_BYTES (SLAB_UNITS * UNIT)
+#define NCLASSES 5
+#define MIN_OBJ 16
+#define WORD_BITS (8 * sizeof(unsigned long))
+#define MAP_WORDS ((SLAB_BYTES / MIN_OBJ + WORD_BITS - 1) / WORD_BITS)
+
+struct cache;
+
+typedef struct slab {
+  block *b;
+  int id;
+  size_t nfree;
+  unsigned long map[MAP_WORDS];
+  struct cache *c;
+  struct slab *next;
+  struct slab *prev;
+} slab;
+
+typedef struct cache {
+  size_t objsize;
+  size_t nobjs;
+  slab partial;
+  slab full;
+  size_t nslabs;
+  size_t allocs;
+  size_t frees;
+  size_t failed;
+  size_t grows;
+  size_t shrinks;
+} cache;
+
+size_t class_sizes[NCLASSES] = {16, 32, 64, 128, 256};
+cache caches[NCLASSES];
+slab **slabs;
+int slab_id = 1 << 30;
+
+void slab_push(slab *head, slab *s) {
+  assert(head && s);
+  slab *tail = head->prev;
+  tail->next = s;
+  s->prev = tail;
+  s->next = head;
+  head->prev = s;
+}
+
+void slab_remove(slab *s) {
+  assert(s && s->prev && s->next);
+  s->next->prev = s->prev;
+  s->prev->next = s->next;
+  s->next = s->prev = s;
+}
+
+void init_slabs() {
+  for (int i = 0; i < NCLASSES; i++) {
+    cache *c = &caches[i];
+    memset(c, 0, sizeof(*c));
+    c->objsize = class_sizes[i];
+    c->nobjs = SLAB_BYTES / c->objsize;
+    c->partial.next = c->partial.prev = &c->partial;
+    c->full.next = c->full.prev = &c->full;
+  }
+  slabs = calloc(maxsize / SLAB_UNITS, sizeof(slab *));
+}
+
+cache *find_cache(size_t size) {
+  for (int i = 0; i < NCLASSES; i++) {
+    if (size <= caches[i].objsize)
+      return &caches[i];
+  }
+  return NULL;
+}
+
+slab *grow(cache *c) {
+  int id = slab_id++;
+  block *b = request(SLAB_UNITS, id);
+  if (b == NULL)
+    return NULL;
+  slab *s = malloc(sizeof(slab));
+  s->b = b;
+  s->id = id;
+  s->c = c;
+  s->nfree = c->nobjs;
+  memset(s->map, 0, sizeof(s->map));
+  for (size_t i = 0; i < c->nobjs; i++) {
+    s->map[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+  }
+  s->next = s->prev = s;
+  slab_push(&c->partial, s);
+  slabs[b->start / SLAB_UNITS] = s;
+  c->nslabs++;
+  c->grows++;
+  return s;
+}
+
+void *slab_alloc(size_t size) {
+  assert(size > 0);
+  cache *c = find_cache(size);
+  if (c == NULL)
+    return NULL;
+  slab *s = c->partial.next;
+  if (s == &c->partial) {
+    s = grow(c);
+    if (s == NULL) {
+      c->failed++;
+      return NULL;
+    }
+  }
+  size_t w = 0;
+  while (s->map[w] == 0) {
+    w++;
+  }
+  size_t i = w * WORD_BITS + __builtin_ctzl(s->map[w]);
+  s->map[w] &= ~(1UL << (i % WORD_BITS));
+  if (--s->nfree == 0) {
+    slab_remove(s);
+    slab_push(&c->full, s);
+  }
+  c->allocs++;
+  return (char *)block_addr(s->b) + i * c->objsize;
+}
+
+void slab_free(void *p) {
+  assert(p);
+  size_t off = (char *)p - arena;
+  slab *s = slabs[off / SLAB_BYTES];
+  assert(s);
+  cache *c = s->c;
+  size_t i = off % SLAB_BYTES / c->objsize;
+  assert(off % SLAB_BYTES % c->objsize == 0);
+  assert((s->map[i / WORD_BITS] & (1UL << (i % WORD_BITS))) == 0);
+  s->map[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+  if (s->nfree++ == 0) {
+    slab_remove(s);
+    slab_push(&c->partial, s);
+  }
+  c->frees++;
+  if (s->nfree == c->nobjs) {
+    slab_remove(s);
+    slabs[s->b->start / SLAB_UNITS] = NULL;
+    freeb(SLAB_UNITS, s->id);
+    free(s);
+    c->nslabs--;
+    c->shrinks++;
+  }
+}
+
+void slab_stats() {
+  for (int i = 0; i < NCLASSES; i++) {
+    cache *c = &caches[i];
+    if (c->allocs == 0 && c->failed == 0)
+      continue;
+    size_t live = c->allocs - c->frees;
+    size_t bytes = c->nslabs * SLAB_BYTES;
+    printf("slab %lu: live %lu slabs %lu used %lu/%lu bytes allocs %lu frees "
+           "%lu failed %lu grows %lu shrinks %lu\n",
+           c->objsize, live, c->nslabs, live * c->objsize, bytes, c->allocs,
+           c->frees, c->failed, c->grows, c->shrinks);
+  }
 }
 
 void display() {
-  for (int i = 0; i < 10; i++) {
-    printf("%d", i);
+  for (size_t i = 0; i < norders; i++) {
+    printf("%lu", i);
     block *head = headers[i];
     for (block *p = head->next; p != head; p = p->next) {
       printf("->%lu(%d)(%lu)", p->size, p->used, p->start);
     }
     printf("\n");
   }
+  slab_stats();
+}
+
+typedef struct op {
+  char kind;
+  int id;
+  size_t size;
+} op;
+
+typedef struct trace {
+  op *ops;
+  size_t n;
+  size_t cap;
+  int maxid;
+} trace;
+
+void trace_add(trace *t, char kind, size_t size, int id) {
+  if (t->n == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 1024;
+    t->ops = realloc(t->ops, t->cap * sizeof(op));
+  }
+  t->ops[t->n].kind = kind;
+  t->ops[t->n].size = size;
+  t->ops[t->n].id = id;
+  t->n++;
+  if (id > t->maxid)
+    t->maxid = id;
+}
+
+int load_trace(trace *t, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  char kind;
+  long size;
+  int id;
+  while (fscanf(fp, " %c%ld%d", &kind, &size, &id) == 3) {
+    if ((kind != 'r' && kind != 'f') || size <= 0 || id <= 0) {
+      fprintf(stderr, "%s: bad op %lu\n", path, t->n + 1);
+      fclose(fp);
+      return -1;
+    }
+    trace_add(t, kind, size, id);
+  }
+  fclose(fp);
+  return 0;
+}
+
+size_t synth_size(int power, size_t maxunits) {
+  size_t size;
+  if (power)
+    size = ((size_t)RAND_MAX + 1) / ((size_t)rand() + 1);
+  else
+    size = 1 + rand() % maxunits;
+  return size > maxunits ? maxunits : size;
+}
+
+void synth_trace(trace *t, int power, char life, size_t nops, size_t target,
+                 size_t maxunits) {
+  int *live = malloc(sizeof(int) * nops);
+  size_t *sizes = malloc(sizeof(size_t) * (nops + 1));
+  size_t lo = 0, hi = 0;
+  int id = 0;
+  while (t->n < nops) {
+    size_t nlive = hi - lo;
+    int alloc = nlive < target ? rand() % 4 != 0 : rand() % 4 == 0;
+    if (alloc || nlive == 0) {
+      id++;
+      sizes[id] = synth_size(power, maxunits);
+      live[hi++] = id;
+      trace_add(t, 'r', sizes[id], id);
+      continue;
+    }
+    int victim;
+    if (life == 'l') {
+      victim = live[--hi];
+    } else if (life == 'f') {
+      victim = live[lo++];
+    } else {
+      size_t i = lo + rand() % nlive;
+      victim = live[i];
+      live[i] = live[--hi];
+    }
+    trace_add(t, 'f', sizes[victim], victim);
+  }
+  while (hi > lo) {
+    int victim = live[--hi];
+    trace_add(t, 'f', sizes[victim], victim);
+  }
+  free(live);
+  free(sizes);
+}
+
+int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+void report_latency(const char *name, uint64_t *lat, size_t n) {
+  if (n == 0)
+    return;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += lat[i];
+  }
+  qsort(lat, n, sizeof(uint64_t), cmp_u64);
+  printf("%s: %lu ops %.0f ops/sec p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu "
+         "ns\n",
+         name, n, sum ? n * 1e9 / sum : 0.0, lat[n / 2], lat[n * 9 / 10],
+         lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+}
+
+void *bench_alloc(int use_malloc, op *o) {
+  if (use_malloc)
+    return malloc(o->size * UNIT);
+  if (compact_budget)
+    return hrequest(o->size, o->id);
+  return request(o->size, o->id);
+}
+
+size_t bench_size(int use_malloc, op *o, void *p) {
+  if (use_malloc)
+    return o->size;
+  if (compact_budget)
+    return ((handle *)p)->b->size;
+  return ((block *)p)->size;
+}
+
+void bench_free(int use_malloc, void *p) {
+  if (use_malloc)
+    free(p);
+  else if (compact_budget)
+    hfree(p);
+  else
+    release(p);
+}
+
+void replay(trace *t, int use_malloc, size_t samples) {
+  void **ptrs = calloc(t->maxid + 1, sizeof(void *));
+  uint64_t *alat = malloc(sizeof(uint64_t) * t->n);
+  uint64_t *flat = malloc(sizeof(uint64_t) * t->n);
+  size_t na = 0, nf = 0, failed = 0, held = 0, peak = 0;
+  size_t every = t->n / samples ? t->n / samples : 1;
+  const char *name = use_malloc ? "malloc" : "buddy";
+  struct mallinfo2 mi0 = mallinfo2();
+  size_t base = mi0.uordblks + mi0.hblkhd;
+
+  // only the allocator calls are timed: sampling the footprint and the
+  // CSV rows would otherwise count against whichever side does more of it
+  uint64_t elapsed = 0;
+
+  printf("%s: op,held_bytes,free_bytes,largest_free_bytes,frag\n", name);
+  for (size_t i = 0; i < t->n; i++) {
+    op *o = &t->ops[i];
+    if (o->kind == 'r') {
+      uint64_t t0 = now_ns();
+      void *p = bench_alloc(use_malloc, o);
+      alat[na] = now_ns() - t0;
+      elapsed += alat[na++];
+      ptrs[o->id] = p;
+      if (p == NULL) {
+        failed++;
+      } else {
+        held += bench_size(use_malloc, o, p);
+        // malloc's footprint includes its headers and padding, which
+        // only mallinfo2 can see
+        size_t footprint = held * UNIT;
+        if (use_malloc) {
+          struct mallinfo2 mi = mallinfo2();
+          footprint = mi.uordblks + mi.hblkhd - base;
+        }
+        if (footprint > peak)
+          peak = footprint;
+      }
+    } else if (ptrs[o->id] != NULL) {
+      void *p = ptrs[o->id];
+      held -= bench_size(use_malloc, o, p);
+      uint64_t t0 = now_ns();
+      bench_free(use_malloc, p);
+      flat[nf] = now_ns() - t0;
+      elapsed += flat[nf++];
+      ptrs[o->id] = NULL;
+    }
+    if (i % every == 0) {
+      if (use_malloc) {
+        struct mallinfo2 mi = mallinfo2();
+        printf("%s: %lu,%lu,%lu,,\n", name, i,
+               mi.uordblks + mi.hblkhd - base, mi.fordblks);
+      } else {
+        size_t total = free_units(), largest = largest_free();
+        printf("%s: %lu,%lu,%lu,%lu,%.3f\n", name, i, held * UNIT,
+               total * UNIT, largest * UNIT, fragmentation());
+      }
+    }
+  }
+  printf("%s: %lu ops in %.3f s, %lu failed requests, peak footprint %lu "
+         "bytes\n",
+         name, t->n, elapsed / 1e9, failed, peak);
+  if (!use_malloc)
+    printf("buddy: %lu splits %lu merges %lu batches, %lu compactions %lu "
+           "moves %lu bytes moved %lu bytes recovered\n",
+           stats.splits, stats.merges, stats.batches, stats.compactions,
+           stats.moves, stats.moved_units * UNIT,
+           stats.recovered_units * UNIT);
+  report_latency(use_malloc ? "malloc alloc" : "buddy alloc", alat, na);
+  report_latency(use_malloc ? "malloc free" : "buddy free", flat, nf);
+  free(ptrs);
+  free(alat);
+  free(flat);
 }
 
-int main(void) {
+int bench(int argc, char **argv) {
+  const char *path = NULL, *out = NULL;
+  int power = 0, with_malloc = 0;
+  char life = 'r';
+  size_t nops = 100000, target = 1000, maxunits = 1024, orders = 21;
+  size_t samples = 20, every = 0, mark = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:w:s:l:n:L:S:o:p:d:z:c:m")) != -1) {
+    switch (opt) {
+    case 't':
+      path = optarg;
+      break;
+    case 'w':
+      out = optarg;
+      break;
+    case 's':
+      power = strcmp(optarg, "power") == 0;
+      break;
+    case 'l':
+      life = optarg[0];
+      break;
+    case 'n':
+      nops = strtoul(optarg, NULL, 10);
+      break;
+    case 'L':
+      target = strtoul(optarg, NULL, 10);
+      break;
+    case 'S':
+      maxunits = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      orders = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      samples = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      every = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      mark = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      compact_budget = strtoull(optarg, NULL, 10);
+      break;
+    case 'm':
+      with_malloc = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: ./buddy bench [-t trace | -s uniform|power -l "
+              "lifo|fifo|random -n ops -L live -S maxunits] [-w out] "
+              "[-o orders] [-p samples] [-d every] [-z watermark] [-c budget_ns] [-m]\n");
+      return 1;
+    }
+  }
+  if (orders == 0 || orders > MAX_ORDERS || maxunits == 0 || samples == 0 ||
+      (life != 'l' && life != 'f' && life != 'r')) {
+    fprintf(stderr, "bad bench arguments\n");
+    return 1;
+  }
+
+  trace t = {NULL, 0, 0, 0};
+  if (path) {
+    if (load_trace(&t, path) < 0)
+      return 2;
+  } else {
+    srand(1);
+    synth_trace(&t, power, life, nops, target, maxunits);
+  }
+  if (out) {
+    FILE *fp = fopen(out, "w");
+    if (fp == NULL) {
+      perror(out);
+      return 2;
+    }
+    for (size_t i = 0; i < t.n; i++) {
+      fprintf(fp, "%c %lu %d\n", t.ops[i].kind, t.ops[i].size, t.ops[i].id);
+    }
+    fclose(fp);
+  }
+
+  verbose = 0;
+  init(orders);
+  stats_dump(stdout, every);
+  set_lazy(mark);
+  replay(&t, 0, samples);
+  stats_dump(NULL, 0);
+  if (with_malloc)
+    replay(&t, 1, samples);
+  free(t.ops);
+  return 0;
+}
+
+void *objects[1024];
+
+int main(int argc, char **argv) {
   int flag = 1;
 
-  init();
+  if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    return bench(argc - 1, argv + 1);
+
+  if (argc > 1 && strcmp(argv[1], "bulk") == 0) {
+    verbose = 0;
+    init(21);
+    bulk_bench();
+    return 0;
+  }
+
+  init(10);
+  init_slabs();
+
+  if (argc > 1 && strcmp(argv[1], "exact") == 0) {
+    exact_savings();
+    return 0;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "compact") == 0) {
+    compact_check();
+    return 0;
+  }
 
   do {
     char order;
     int size;
     int id;
     printf("请输入命令:以空格相隔\n");
-    scanf("%c%d%d", &order, &size, &id);
+    if (scanf(" %c", &order) != 1)
+      break;
+    // q takes no arguments; anything after it on the line is ignored
+    if (order == 'q')
+      scanf("%*[^\n]");
+    else if (scanf("%d%d", &size, &id) != 2)
+      break;
     if (order == 'r') {
       request(size, id);
     } else if (order == 'f') {
       freeb(size, id);
+    } else if (order == 'e') {
+      request_exact(size, id);
+    } else if (order == 'x') {
+      freeb_exact(size, id);
+    } else if (order == 'a' && id > 0 && id < 1024 && objects[id] == NULL) {
+      objects[id] = slab_alloc(size);
+    } else if (order == 'd' && id > 0 && id < 1024 && objects[id] != NULL) {
+      slab_free(objects[id]);
+      objects[id] = NULL;
+    } else if (order == 'q') {
+      dump_stats(stdout);
     } else {
       printf("error %c!\n", order);
     }
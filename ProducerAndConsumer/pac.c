@@ -1,73 +1,2060 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 struct th_info {
     int id;
+    int cpu;
+    struct log_ring *log;
 };
 
-int buffer;
+struct product {
+    int value;
+    uint32_t seq;
+    uint64_t stamp;
+};
+
+struct queue_ops {
+    const char *name;
+    void (*put)(struct product product);
+    int (*get)(struct product *product);
+    void (*put_batch)(const struct product *products, int n);
+    int (*get_batch)(struct product *products, int max);
+};
+
+int nItems = 10;
+int batch = 1;
+int quiet = 0;
+int bench = 0;
+uint64_t deadline;
+atomic_int stopping;
+const struct queue_ops *queue;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct product buffer;
 int empty = 1;
 pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t full_cond = PTHREAD_COND_INITIALIZER;
 pthread_cond_t empty_cond = PTHREAD_COND_INITIALIZER;
 
-void make_product(int tid) {
+void slot_put(struct product product) {
     pthread_mutex_lock(&buffer_mutex);
     while (!empty) {
         pthread_cond_wait(&empty_cond, &buffer_mutex);
     }
-    int product = rand() % 1000;
     buffer = product;
     empty = 0;
-    printf("producer %d produce product %d\n", tid, product);
     pthread_cond_signal(&full_cond);
     pthread_mutex_unlock(&buffer_mutex);
 }
 
-void consume_product(int tid) {
+int slot_get(struct product *product) {
     pthread_mutex_lock(&buffer_mutex);
-    while (empty) {
+    while (empty && !stopping) {
         pthread_cond_wait(&full_cond, &buffer_mutex);
     }
-    printf("consumer %d cosume product %d\n", tid, buffer);
+    if (empty) {
+        pthread_mutex_unlock(&buffer_mutex);
+        return 0;
+    }
+    *product = buffer;
     empty = 1;
     pthread_cond_signal(&empty_cond);
     pthread_mutex_unlock(&buffer_mutex);
+    return 1;
+}
+
+void slot_put_batch(const struct product *products, int n) {
+    pthread_mutex_lock(&buffer_mutex);
+    for (int i = 0; i < n; i++) {
+        while (!empty) {
+            pthread_cond_wait(&empty_cond, &buffer_mutex);
+        }
+        buffer = products[i];
+        empty = 0;
+        pthread_cond_signal(&full_cond);
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+}
+
+int slot_get_batch(struct product *products, int max) {
+    (void)max;
+    return slot_get(products);
+}
+
+enum { WAIT_SPIN, WAIT_YIELD, WAIT_PARK, WAIT_BLOCK };
+
+const char *strategies[] = {"spin", "yield", "park", "block"};
+int strategy = WAIT_BLOCK;
+
+#define SPIN_LIMIT 128
+#define CACHE_LINE 64
+
+struct waiter {
+    atomic_int waiters;
+    atomic_uint seq;
+    int shared;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void waiter_init(struct waiter *w) {
+    atomic_init(&w->waiters, 0);
+    atomic_init(&w->seq, 0);
+    w->shared = 0;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+}
+
+void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// A sleeper counts itself in waiters and retries before sleeping; the
+// other side publishes, fences, then reads waiters, so either the retry
+// succeeds or the sleeper is woken. Nobody registered means no syscall.
+unsigned wait_prepare(struct waiter *w) {
+    if (strategy == WAIT_BLOCK)
+        pthread_mutex_lock(&w->mutex);
+    atomic_fetch_add(&w->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&w->seq, memory_order_relaxed);
+}
+
+void wait_commit(struct waiter *w, unsigned seq) {
+    if (strategy == WAIT_BLOCK)
+        pthread_cond_wait(&w->cond, &w->mutex);
+    else
+        syscall(SYS_futex, &w->seq, w->shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+                seq, NULL, NULL, 0);
+}
+
+void wait_finish(struct waiter *w) {
+    atomic_fetch_sub(&w->waiters, 1);
+    if (strategy == WAIT_BLOCK)
+        pthread_mutex_unlock(&w->mutex);
+}
+
+void notify(struct waiter *w, int all) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&w->waiters, memory_order_relaxed) == 0)
+        return;
+    if (strategy == WAIT_BLOCK) {
+        pthread_mutex_lock(&w->mutex);
+        if (all)
+            pthread_cond_broadcast(&w->cond);
+        else
+            pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+    } else {
+        atomic_fetch_add(&w->seq, 1);
+        syscall(SYS_futex, &w->seq, w->shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+                all ? INT_MAX : 1, NULL, NULL, 0);
+    }
+}
+
+#define WAIT_FOR(w, k, try)                                                    \
+    for (int round = 0; ((k) = (try)) == 0 && !stopping; round++) {           \
+        if (strategy == WAIT_SPIN ||                                           \
+            (strategy != WAIT_BLOCK && round < SPIN_LIMIT)) {                  \
+            cpu_relax();                                                       \
+        } else if (strategy == WAIT_YIELD) {                                   \
+            sched_yield();                                                     \
+        } else {                                                               \
+            unsigned seq = wait_prepare(w);                                    \
+            if (((k) = (try)) == 0 && !stopping)                               \
+                wait_commit(w, seq);                                           \
+            wait_finish(w);                                                    \
+            if (k)                                                             \
+                break;                                                         \
+        }                                                                      \
+    }
+
+struct cell {
+    atomic_size_t seq;
+    struct product product;
+};
+
+// head and tail get a cache line each so producers bumping one do not
+// keep invalidating the line consumers read the other from. The cells are
+// found at an offset from the ring itself, so a ring placed in shared
+// memory works wherever each process happens to map it.
+struct ring {
+    uintptr_t cells;
+    size_t mask;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) struct waiter not_full;
+    struct waiter not_empty;
+};
+
+struct ring ring;
+
+struct cell *ring_cell(struct ring *r, size_t pos) {
+    return (struct cell *)((uintptr_t)r + r->cells) + (pos & r->mask);
+}
+
+size_t ring_size(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+void ring_setup(struct ring *r, size_t size, struct cell *cells) {
+    r->cells = (uintptr_t)cells - (uintptr_t)r;
+    r->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&cells[i].seq, i);
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    waiter_init(&r->not_full);
+    waiter_init(&r->not_empty);
+}
+
+void ring_init(struct ring *r, size_t capacity) {
+    size_t size = ring_size(capacity);
+    ring_setup(r, size, malloc(sizeof(struct cell) * size));
+}
+
+int ring_try_put(struct ring *r, struct product product) {
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    for (;;) {
+        struct cell *c = ring_cell(r, pos);
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        long dif = (long)(seq - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                c->product = product;
+                atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+}
+
+int ring_try_get(struct ring *r, struct product *product) {
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (;;) {
+        struct cell *c = ring_cell(r, pos);
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        long dif = (long)(seq - (pos + 1));
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *product = c->product;
+                atomic_store_explicit(&c->seq, pos + r->mask + 1,
+                                      memory_order_release);
+                return 1;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+}
+
+int ring_try_put_batch(struct ring *r, const struct product *products, int n) {
+    size_t size = r->mask + 1, k;
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    for (;;) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if ((long)(pos - tail) < 0) {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+            continue;
+        }
+        if (pos - tail >= size)
+            return 0;
+        k = size - (pos - tail);
+        if (k > (size_t)n)
+            k = n;
+        if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + k,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            break;
+    }
+    for (size_t i = 0; i < k; i++) {
+        struct cell *c = ring_cell(r, pos + i);
+        while (atomic_load_explicit(&c->seq, memory_order_acquire) != pos + i) {
+            sched_yield();
+        }
+        c->product = products[i];
+        atomic_store_explicit(&c->seq, pos + i + 1, memory_order_release);
+    }
+    return k;
+}
+
+int ring_try_get_batch(struct ring *r, struct product *products, int max) {
+    size_t size = r->mask + 1, k;
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    do {
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if ((long)(head - pos) <= 0)
+            return 0;
+        k = head - pos;
+        if (k > (size_t)max)
+            k = max;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &r->tail, &pos, pos + k, memory_order_relaxed, memory_order_relaxed));
+    for (size_t i = 0; i < k; i++) {
+        struct cell *c = ring_cell(r, pos + i);
+        while (atomic_load_explicit(&c->seq, memory_order_acquire) !=
+               pos + i + 1) {
+            sched_yield();
+        }
+        products[i] = c->product;
+        atomic_store_explicit(&c->seq, pos + i + size, memory_order_release);
+    }
+    return k;
+}
+
+void ring_push(struct ring *r, struct product product) {
+    int k;
+    WAIT_FOR(&r->not_full, k, ring_try_put(r, product));
+    notify(&r->not_empty, 0);
+}
+
+int ring_pop(struct ring *r, struct product *product) {
+    int k;
+    WAIT_FOR(&r->not_empty, k, ring_try_get(r, product));
+    if (k)
+        notify(&r->not_full, 0);
+    return k;
+}
+
+void ring_put(struct product product) { ring_push(&ring, product); }
+
+int ring_get(struct product *product) { return ring_pop(&ring, product); }
+
+void ring_put_batch(const struct product *products, int n) {
+    int done = 0;
+    while (done < n) {
+        int k = ring_try_put_batch(&ring, products + done, n - done);
+        if (k == 0) {
+            notify(&ring.not_empty, 0);
+            WAIT_FOR(&ring.not_full, k,
+                     ring_try_put_batch(&ring, products + done, n - done));
+        }
+        done += k;
+    }
+    notify(&ring.not_empty, 0);
+}
+
+int ring_get_batch(struct product *products, int max) {
+    int k;
+    WAIT_FOR(&ring.not_empty, k, ring_try_get_batch(&ring, products, max));
+    if (k)
+        notify(&ring.not_full, 0);
+    return k;
+}
+
+struct ring *shards;
+int nShards;
+int nHomes;
+atomic_long steals;
+struct waiter idle;
+__thread int self;
+
+void shards_init(int n, int consumers, size_t capacity) {
+    shards = aligned_alloc(CACHE_LINE, sizeof(struct ring) * n);
+    for (int i = 0; i < n; i++) {
+        ring_init(&shards[i], capacity);
+    }
+    nShards = n;
+    nHomes = consumers;
+    waiter_init(&idle);
+}
+
+int shard_try_put(struct ring *r, struct product product) {
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct cell *c = ring_cell(r, pos);
+    if (atomic_load_explicit(&c->seq, memory_order_acquire) != pos)
+        return 0;
+    c->product = product;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&r->head, pos + 1, memory_order_release);
+    return 1;
+}
+
+int is_home(int shard, int consumer) {
+    if (nHomes <= nShards)
+        return shard % nHomes == consumer;
+    return shard == consumer % nShards;
+}
+
+int shard_scan(struct product *products, int max, int *from) {
+    int start = self % nShards;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nShards; i++) {
+            int s = (start + i) % nShards;
+            if (is_home(s, self) != (pass == 0))
+                continue;
+            int k = max == 1 ? ring_try_get(&shards[s], products)
+                             : ring_try_get_batch(&shards[s], products, max);
+            if (k > 0) {
+                if (pass)
+                    atomic_fetch_add_explicit(&steals, 1, memory_order_relaxed);
+                *from = s;
+                return k;
+            }
+        }
+    }
+    return 0;
+}
+
+void shard_put_batch(const struct product *products, int n) {
+    struct ring *r = &shards[self];
+    for (int i = 0; i < n; i++) {
+        if (shard_try_put(r, products[i]))
+            continue;
+        notify(&idle, 0);
+        int k;
+        WAIT_FOR(&r->not_full, k, shard_try_put(r, products[i]));
+    }
+    notify(&idle, 0);
+}
+
+void shard_put(struct product product) { shard_put_batch(&product, 1); }
+
+int shard_get_batch(struct product *products, int max) {
+    int from, k;
+    WAIT_FOR(&idle, k, shard_scan(products, max, &from));
+    if (k)
+        notify(&shards[from].not_full, 0);
+    return k;
+}
+
+int shard_get(struct product *product) { return shard_get_batch(product, 1); }
+
+// Variable-size messages live inline in one byte buffer, each behind an
+// 8-byte header. head, tail and reclaim are byte positions that only grow:
+// producers reserve at head, consumers claim at tail, and released space
+// is handed back at reclaim once everything before it is released too.
+// A message that would straddle the end is preceded by a pad record.
+enum { MSG_RESERVED = 1, MSG_COMMITTED, MSG_PAD, MSG_RELEASED };
+#define MSG_BUSY 1
+#define MSG_PENDING 2
+
+struct msg_hdr {
+    atomic_uint state;
+    uint32_t len;
+};
+
+struct msgq {
+    char *buf;
+    size_t size;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) atomic_size_t reclaim;
+    _Alignas(CACHE_LINE) struct waiter not_full;
+    struct waiter not_empty;
+};
+
+struct msgq msgq;
+int maxLen = 64;
+
+size_t msg_total(size_t len) {
+    return (sizeof(struct msg_hdr) + len + 7) & ~(size_t)7;
+}
+
+void msgq_init(struct msgq *q, size_t capacity, size_t maxlen) {
+    size_t slot = msg_total(sizeof(struct product) + maxlen);
+    q->size = (capacity < 2 ? 2 : capacity) * slot;
+    q->buf = calloc(q->size, 1);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->reclaim, 0);
+    waiter_init(&q->not_full);
+    waiter_init(&q->not_empty);
+}
+
+int msg_try_reserve(struct msgq *q, size_t len, void **msg) {
+    size_t total = msg_total(len), pad;
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        size_t off = pos % q->size;
+        pad = off + total > q->size ? q->size - off : 0;
+        size_t reclaim =
+            atomic_load_explicit(&q->reclaim, memory_order_acquire) &
+            ~(size_t)(MSG_BUSY | MSG_PENDING);
+        if ((long)(pos - reclaim) < 0) {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+            continue;
+        }
+        if (pos + pad + total - reclaim > q->size)
+            return 0;
+        // release: a claimer that sees this head also sees the zeroing
+        // the reclaimer did before it moved reclaim past this space
+        if (atomic_compare_exchange_weak_explicit(&q->head, &pos,
+                                                  pos + pad + total,
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+            break;
+    }
+    struct msg_hdr *h = (struct msg_hdr *)(q->buf + pos % q->size);
+    if (pad) {
+        h->len = pad - sizeof(struct msg_hdr);
+        atomic_store_explicit(&h->state, MSG_PAD, memory_order_release);
+        h = (struct msg_hdr *)q->buf;
+    }
+    h->len = len;
+    atomic_store_explicit(&h->state, MSG_RESERVED, memory_order_relaxed);
+    *msg = h + 1;
+    return 1;
+}
+
+void msg_release(struct msgq *q, void *msg);
+
+// Claims are FIFO: a reserved but uncommitted message at tail holds back
+// the ones behind it, the same as an unfilled cell in the ring. Claimers
+// take bit 0 of tail the way releasers take reclaim, so the header at tail
+// is only read while nobody can move past it, release it and zero it.
+int msg_try_claim(struct msgq *q, void **msg, size_t *len) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        if (pos & MSG_BUSY) {
+            sched_yield();
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+            continue;
+        }
+        // when full, the header at head is a claimed message, not a new one
+        size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if ((long)(head - pos) <= 0)
+            return 0;
+        if (!atomic_compare_exchange_weak_explicit(&q->tail, &pos,
+                                                   pos | MSG_BUSY,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed))
+            continue;
+        struct msg_hdr *h = (struct msg_hdr *)(q->buf + pos % q->size);
+        unsigned state = atomic_load_explicit(&h->state, memory_order_acquire);
+        if (state != MSG_COMMITTED && state != MSG_PAD) {
+            atomic_store_explicit(&q->tail, pos, memory_order_release);
+            return 0;
+        }
+        size_t total = msg_total(h->len);
+        atomic_store_explicit(&q->tail, pos + total, memory_order_release);
+        if (state == MSG_COMMITTED) {
+            *msg = h + 1;
+            *len = h->len;
+            return 1;
+        }
+        msg_release(q, h + 1);
+        pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+}
+
+void msg_commit(struct msgq *q, void *msg) {
+    struct msg_hdr *h = (struct msg_hdr *)msg - 1;
+    atomic_store_explicit(&h->state, MSG_COMMITTED, memory_order_release);
+    notify(&q->not_empty, 0);
+}
+
+// Positions are multiples of 8, so the low bits of reclaim are free for
+// flags. Bit 0 marks it busy: only the thread that set it reads headers at
+// reclaim, which are then known to belong to the current lap, and it
+// zeroes each released message so stale bytes never read as a header.
+// A release that finds reclaim busy sets bit 1 instead of touching the
+// ring. The owner lets go with a CAS that fails while that bit is set,
+// so it goes round again and picks up the late release itself.
+void msg_release(struct msgq *q, void *msg) {
+    struct msg_hdr *h = (struct msg_hdr *)msg - 1;
+    atomic_store(&h->state, MSG_RELEASED);
+    size_t r = atomic_load(&q->reclaim);
+    for (;;) {
+        if (r & MSG_BUSY) {
+            if ((r & MSG_PENDING) ||
+                atomic_compare_exchange_weak(&q->reclaim, &r,
+                                             r | MSG_PENDING))
+                return;
+        } else if (atomic_compare_exchange_weak(&q->reclaim, &r,
+                                                r | MSG_BUSY)) {
+            break;
+        }
+    }
+    size_t held = r | MSG_BUSY;
+    int freed = 0;
+    for (;;) {
+        for (;;) {
+            h = (struct msg_hdr *)(q->buf + r % q->size);
+            if (atomic_load(&h->state) != MSG_RELEASED)
+                break;
+            size_t total = msg_total(h->len);
+            memset(h, 0, total);
+            r += total;
+            freed = 1;
+        }
+        if (atomic_compare_exchange_strong(&q->reclaim, &held, r))
+            break;
+        // a release came in while we held reclaim; publish progress, rescan
+        held = r | MSG_BUSY;
+        atomic_store(&q->reclaim, held);
+    }
+    if (freed)
+        notify(&q->not_full, 0);
+}
+
+void *msg_reserve(struct msgq *q, size_t len) {
+    void *msg = NULL;
+    int k;
+    WAIT_FOR(&q->not_full, k, msg_try_reserve(q, len, &msg));
+    return k ? msg : NULL;
+}
+
+void *msg_claim(struct msgq *q, size_t *len) {
+    void *msg = NULL;
+    int k;
+    WAIT_FOR(&q->not_empty, k, msg_try_claim(q, &msg, len));
+    return k ? msg : NULL;
+}
+
+// The product is built straight into the ring, followed by value % (maxLen
+// + 1) payload bytes that the consumer checks in place.
+void msg_put(struct product product) {
+    size_t extra = product.value % (maxLen + 1);
+    struct product *m = msg_reserve(&msgq, sizeof(struct product) + extra);
+    if (m == NULL)
+        return;
+    *m = product;
+    memset(m + 1, product.value & 0xff, extra);
+    msg_commit(&msgq, m);
+}
+
+void msg_read(void *msg, size_t len, struct product *product) {
+    struct product *m = msg;
+    const unsigned char *data = (const unsigned char *)(m + 1);
+    size_t extra = len - sizeof(struct product);
+    if (extra != (size_t)(m->value % (maxLen + 1))) {
+        fprintf(stderr, "msg: bad length %zu for product %d\n", len, m->value);
+        abort();
+    }
+    for (size_t i = 0; i < extra; i++) {
+        if (data[i] != (m->value & 0xff)) {
+            fprintf(stderr, "msg: corrupt payload for product %d\n", m->value);
+            abort();
+        }
+    }
+    *product = *m;
+    msg_release(&msgq, msg);
+}
+
+int msg_get(struct product *product) {
+    size_t len;
+    void *msg = msg_claim(&msgq, &len);
+    if (msg == NULL)
+        return 0;
+    msg_read(msg, len, product);
+    return 1;
+}
+
+void msg_put_batch(const struct product *products, int n) {
+    for (int i = 0; i < n; i++) {
+        msg_put(products[i]);
+    }
+}
+
+int msg_get_batch(struct product *products, int max) {
+    size_t len;
+    void *msg;
+    if (!msg_get(products))
+        return 0;
+    int k = 1;
+    while (k < max && msg_try_claim(&msgq, &msg, &len)) {
+        msg_read(msg, len, products + k++);
+    }
+    return k;
+}
+
+const struct queue_ops queues[] = {
+    {"slot", slot_put, slot_get, slot_put_batch, slot_get_batch},
+    {"ring", ring_put, ring_get, ring_put_batch, ring_get_batch},
+    {"shard", shard_put, shard_get, shard_put_batch, shard_get_batch},
+    {"msg", msg_put, msg_get, msg_put_batch, msg_get_batch},
+};
+
+void stop_queues(void) {
+    atomic_store(&stopping, 1);
+    pthread_mutex_lock(&buffer_mutex);
+    pthread_cond_broadcast(&full_cond);
+    pthread_mutex_unlock(&buffer_mutex);
+    notify(&ring.not_empty, 1);
+    notify(&idle, 1);
+    notify(&msgq.not_empty, 1);
+}
+
+enum { PLACE_NONE, PLACE_COMPACT, PLACE_SCATTER, PLACE_PAIR, PLACE_LIST };
+
+const char *placements[] = {"none", "compact", "scatter", "pair", "list"};
+int placement = PLACE_NONE;
+
+// rank is the CPU's position among its hyperthread siblings, slot the
+// core's position within its package.
+struct cpu {
+    int id;
+    int package;
+    int core;
+    int rank;
+    int slot;
+};
+
+struct cpu *compact;
+struct cpu *scatter;
+int nCpus;
+int cpuList[CPU_SETSIZE];
+int nCpuList;
+
+int read_topology(int cpu, const char *name) {
+    char path[128];
+    int value = -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+             cpu, name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    if (fscanf(fp, "%d", &value) != 1)
+        value = -1;
+    fclose(fp);
+    return value;
+}
+
+int by_core(const void *a, const void *b) {
+    const struct cpu *x = a, *y = b;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->id - y->id;
+}
+
+int by_spread(const void *a, const void *b) {
+    const struct cpu *x = a, *y = b;
+    if (x->rank != y->rank)
+        return x->rank - y->rank;
+    if (x->slot != y->slot)
+        return x->slot - y->slot;
+    return x->package - y->package;
+}
+
+// Only CPUs this process may run on are considered. Without topology
+// files every CPU counts as its own core in package 0.
+void topology_init(void) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    compact = malloc(sizeof(struct cpu) * CPU_COUNT(&set));
+    scatter = malloc(sizeof(struct cpu) * CPU_COUNT(&set));
+    nCpus = 0;
+    for (int id = 0; id < CPU_SETSIZE; id++) {
+        if (!CPU_ISSET(id, &set))
+            continue;
+        struct cpu *c = &compact[nCpus++];
+        c->id = id;
+        c->package = read_topology(id, "physical_package_id");
+        c->core = read_topology(id, "core_id");
+        if (c->package < 0)
+            c->package = 0;
+        if (c->core < 0)
+            c->core = id;
+    }
+    qsort(compact, nCpus, sizeof(struct cpu), by_core);
+    for (int i = 0; i < nCpus; i++) {
+        struct cpu *c = &compact[i], *prev = i ? &compact[i - 1] : NULL;
+        if (prev && prev->package == c->package && prev->core == c->core) {
+            c->rank = prev->rank + 1;
+            c->slot = prev->slot;
+        } else {
+            c->rank = 0;
+            c->slot = prev && prev->package == c->package ? prev->slot + 1 : 0;
+        }
+    }
+    memcpy(scatter, compact, sizeof(struct cpu) * nCpus);
+    qsort(scatter, nCpus, sizeof(struct cpu), by_spread);
+}
+
+// compact fills each core's hyperthreads before moving on, scatter puts
+// one thread per core (alternating packages) before doubling up, and pair
+// gives producer i and consumer i the two siblings of the i-th core.
+int cpu_for(int consumer, int i, int nProducers) {
+    int t = consumer ? nProducers + i : i;
+    switch (placement) {
+    case PLACE_COMPACT:
+        return compact[t % nCpus].id;
+    case PLACE_SCATTER:
+        return scatter[t % nCpus].id;
+    case PLACE_PAIR: {
+        int cores = 0, core = 0;
+        for (int j = 0; j < nCpus; j++) {
+            cores += compact[j].rank == 0;
+        }
+        for (int j = 0, n = 0; j < nCpus; j++) {
+            if (compact[j].rank == 0 && n++ == i % cores)
+                core = j;
+        }
+        if (consumer && core + 1 < nCpus && compact[core + 1].rank == 1)
+            core++;
+        return compact[core].id;
+    }
+    case PLACE_LIST:
+        return cpuList[t % nCpuList];
+    }
+    return -1;
+}
+
+void pin(int cpu) {
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+        fprintf(stderr, "pthread_setaffinity_np cpu %d: %s\n", cpu,
+                strerror(err));
+}
+
+// Event log: every thread appends fixed-size binary events to its own
+// single-writer ring and never waits on it; when the ring is full the
+// event is counted as dropped. One writer thread drains all rings,
+// formats into a large block and hands it to stdout a block at a time.
+enum { EV_PRODUCER_START, EV_CONSUMER_START, EV_PRODUCE, EV_CONSUME, EV_SINK };
+
+struct event {
+    int kind;
+    int tid;
+    int value;
+};
+
+struct log_ring {
+    struct event *events;
+    size_t mask;
+    size_t cached_tail;
+    long dropped;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+};
+
+#define LOG_BLOCK 65536
+
+struct log_ring *logs;
+int nLogs;
+size_t logSize = 65536;
+atomic_int log_done;
+pthread_t log_thread;
+__thread struct log_ring *log_self;
+
+void log_event(int kind, int tid, int value) {
+    struct log_ring *r = log_self;
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - r->cached_tail > r->mask) {
+        r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->cached_tail > r->mask) {
+            r->dropped++;
+            return;
+        }
+    }
+    struct event *e = &r->events[head & r->mask];
+    e->kind = kind;
+    e->tid = tid;
+    e->value = value;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+int format_event(char *out, size_t room, const struct event *e) {
+    switch (e->kind) {
+    case EV_PRODUCER_START:
+        return snprintf(out, room, "producer %d start!\n", e->tid);
+    case EV_CONSUMER_START:
+        return snprintf(out, room, "consumer %d start!\n", e->tid);
+    case EV_PRODUCE:
+        return snprintf(out, room, "producer %d produce product %d\n", e->tid,
+                        e->value);
+    case EV_SINK:
+        return snprintf(out, room, "sink %u: %d\n", (unsigned)e->tid,
+                        e->value);
+    default:
+        return snprintf(out, room, "consumer %d cosume product %d\n", e->tid,
+                        e->value);
+    }
+}
+
+size_t log_drain(char *block, size_t *used) {
+    size_t drained = 0;
+    for (int i = 0; i < nLogs; i++) {
+        struct log_ring *r = &logs[i];
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        drained += head - tail;
+        for (; tail != head; tail++) {
+            if (LOG_BLOCK - *used < 64) {
+                fwrite(block, 1, *used, stdout);
+                *used = 0;
+            }
+            *used += format_event(block + *used, LOG_BLOCK - *used,
+                                  &r->events[tail & r->mask]);
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    return drained;
+}
+
+void *log_writer(void *arg) {
+    (void)arg;
+    char *block = malloc(LOG_BLOCK);
+    size_t used = 0;
+    struct timespec nap = {0, 1000000};
+    for (;;) {
+        int done = atomic_load(&log_done);
+        if (log_drain(block, &used) > 0)
+            continue;
+        if (done)
+            break;
+        if (used > 0) {
+            fwrite(block, 1, used, stdout);
+            used = 0;
+        }
+        nanosleep(&nap, NULL);
+    }
+    fwrite(block, 1, used, stdout);
+    fflush(stdout);
+    free(block);
+    return NULL;
+}
+
+void log_start(int n) {
+    size_t size = 2;
+    while (size < logSize) {
+        size <<= 1;
+    }
+    logs = aligned_alloc(CACHE_LINE, sizeof(struct log_ring) * n);
+    for (int i = 0; i < n; i++) {
+        logs[i].events = malloc(sizeof(struct event) * size);
+        logs[i].mask = size - 1;
+        logs[i].cached_tail = 0;
+        logs[i].dropped = 0;
+        atomic_init(&logs[i].head, 0);
+        atomic_init(&logs[i].tail, 0);
+    }
+    nLogs = n;
+    atomic_store(&log_done, 0);
+    pthread_create(&log_thread, NULL, log_writer, NULL);
+}
+
+// Call once every logging thread has been joined.
+void log_stop(void) {
+    atomic_store(&log_done, 1);
+    pthread_join(log_thread, NULL);
+    long dropped = 0;
+    for (int i = 0; i < nLogs; i++) {
+        dropped += logs[i].dropped;
+        free(logs[i].events);
+    }
+    if (dropped)
+        fprintf(stderr, "log: %ld events dropped\n", dropped);
+    free(logs);
+}
+
+#define NBUCKETS 1024
+
+struct th_stats {
+    long items;
+    long hist[NBUCKETS];
+};
+
+int bucket(uint64_t ns) {
+    if (ns < 16)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (e - 3) * 16 + ((ns >> (e - 4)) & 15);
+}
+
+uint64_t bucket_value(int b) {
+    if (b < 16)
+        return b;
+    return (uint64_t)(16 + b % 16) << (b / 16 - 1);
+}
+
+// xoshiro256**, one generator per producer. Each producer's state is
+// seeded from the run seed and its id through splitmix64, so a producer
+// draws the same values whatever the thread count or interleaving.
+struct rng {
+    uint64_t s[4];
+};
+
+uint64_t seed = 1;
+__thread struct rng rng;
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(struct rng *r, uint64_t base, int stream) {
+    uint64_t x = base ^ ((uint64_t)stream * 0xd1b54a32d192ed03);
+    for (int i = 0; i < 4; i++) {
+        r->s[i] = splitmix64(&x);
+    }
+}
+
+uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t out = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return out;
+}
+
+// Fills a whole batch before the caller touches the queue. The top 32
+// bits are scaled into [0, bound) with a multiply instead of a modulo.
+void rng_fill(struct rng *r, struct product *products, int n, int bound) {
+    for (int i = 0; i < n; i++) {
+        products[i].value = (int)(((rng_next(r) >> 32) * bound) >> 32);
+    }
+}
+
+void make_product(int tid, struct product *products, int n) {
+    rng_fill(&rng, products, n, 1000);
+    if (bench) {
+        uint64_t now = now_ns();
+        for (int i = 0; i < n; i++) {
+            products[i].stamp = now;
+        }
+    }
+    if (n == 1)
+        queue->put(products[0]);
+    else
+        queue->put_batch(products, n);
+    for (int i = 0; i < n && !quiet; i++) {
+        log_event(EV_PRODUCE, tid, products[i].value);
+    }
+}
+
+int consume_product(int tid, struct product *products, struct th_stats *st) {
+    int n = batch == 1 ? queue->get(products)
+                       : queue->get_batch(products, batch);
+    if (bench) {
+        uint64_t now = now_ns();
+        for (int i = 0; i < n; i++) {
+            st->hist[bucket(now - products[i].stamp)]++;
+        }
+    }
+    st->items += n;
+    for (int i = 0; i < n && !quiet; i++) {
+        log_event(EV_CONSUME, tid, products[i].value);
+    }
+    return n;
 }
 
 void *producer(void *arg) {
     struct th_info *info = (struct th_info *)(arg);
-    printf("producer %d start!\n", info->id);
-    for (int i = 0; i < 10; i++) {
-        make_product(info->id);
+    self = info->id;
+    pin(info->cpu);
+    log_self = info->log;
+    rng_seed(&rng, seed, info->id);
+    if (!quiet)
+        log_event(EV_PRODUCER_START, info->id, 0);
+    struct th_stats *st = calloc(1, sizeof(struct th_stats));
+    struct product *products = malloc(sizeof(struct product) * batch);
+    for (int i = 0; i < nItems; i += batch) {
+        if (stopping || (deadline && now_ns() >= deadline))
+            break;
+        int n = nItems - i < batch ? nItems - i : batch;
+        make_product(info->id, products, n);
+        st->items += n;
     }
+    free(products);
     free(arg);
-    return NULL;
+    return st;
 }
 
 void *consumer(void *arg) {
-    pthread_detach(pthread_self());
     struct th_info *info = (struct th_info *)(arg);
-    printf("consumer %d start!\n", info->id);
-    while (1) {
-        consume_product(info->id);
+    self = info->id;
+    pin(info->cpu);
+    log_self = info->log;
+    if (!quiet)
+        log_event(EV_CONSUMER_START, info->id, 0);
+    struct th_stats *st = calloc(1, sizeof(struct th_stats));
+    struct product *products = malloc(sizeof(struct product) * batch);
+    while (consume_product(info->id, products, st) > 0) {
     }
+    free(products);
     free(arg);
+    return st;
+}
+
+uint64_t percentile(const long *hist, long total, double p) {
+    long want = (long)(total * p), seen = 0;
+    for (int b = 0; b < NBUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return bucket_value(b);
+    }
+    return 0;
+}
+
+void report(int nProducers, int nConsumers, size_t capacity, long produced,
+            long consumed, const long *hist, double secs,
+            const struct rusage *ru0, const struct rusage *ru1, int header) {
+    if (!bench) {
+        printf("%s: %d producers %d consumers %ld items in %.3f s, %.0f "
+               "items/sec\n",
+               queue->name, nProducers, nConsumers, consumed, secs,
+               consumed / secs);
+        if (queue->put == shard_put)
+            printf("shard: %ld steals\n", atomic_load(&steals));
+        return;
+    }
+    if (header)
+        printf("queue,wait,affinity,producers,consumers,capacity,batch,"
+               "produced,consumed,seconds,items_per_sec,p50_ns,p90_ns,p99_ns,"
+               "p999_ns,max_ns,cpu_seconds,vcsw,ivcsw\n");
+    uint64_t max = 0;
+    for (int b = 0; b < NBUCKETS; b++) {
+        if (hist[b])
+            max = bucket_value(b);
+    }
+    double cpu = (ru1->ru_utime.tv_sec - ru0->ru_utime.tv_sec) +
+                 (ru1->ru_stime.tv_sec - ru0->ru_stime.tv_sec) +
+                 (ru1->ru_utime.tv_usec - ru0->ru_utime.tv_usec) / 1e6 +
+                 (ru1->ru_stime.tv_usec - ru0->ru_stime.tv_usec) / 1e6;
+    printf("%s,%s,%s,%d,%d,%lu,%d,%ld,%ld,%.6f,%.0f,%lu,%lu,%lu,%lu,%lu,%.3f,"
+           "%ld,%ld\n",
+           queue->name, strategies[strategy], placements[placement],
+           nProducers, nConsumers,
+           capacity, batch, produced, consumed, secs, consumed / secs,
+           percentile(hist, consumed, 0.5), percentile(hist, consumed, 0.9),
+           percentile(hist, consumed, 0.99),
+           percentile(hist, consumed, 0.999), max, cpu,
+           ru1->ru_nvcsw - ru0->ru_nvcsw, ru1->ru_nivcsw - ru0->ru_nivcsw);
+}
+
+// Pipeline: stages run in order, each with its own threads, and each pair
+// of neighbours shares a bounded ring. A full ring blocks the stage that
+// feeds it, so a slow stage pushes back all the way to the source. Stage
+// functions work in place and pass every item on. When the last thread
+// of a stage exits it queues one EOS item per downstream thread.
+//
+// pipeline_run() takes any chain of stages. Callers fill in name, fn,
+// threads and work and leave the rest zeroed; the first stage is fed
+// seq 0..nItems-1 and, with -o, the last one sees them in order.
+#define EOS UINT32_MAX
+
+struct stage {
+    const char *name;
+    void (*fn)(struct stage *s, struct product *p);
+    int threads;
+    int work;
+    struct ring *in;
+    struct ring *out;
+    struct stage *next;
+    atomic_int active;
+    atomic_uint source;
+    atomic_long items;
+    atomic_long in_stall;
+    atomic_long out_stall;
+    atomic_long depth_sum;
+    atomic_long depth_max;
+    atomic_long sum;
+};
+
+struct reorder {
+    pthread_mutex_t mutex;
+    struct product *heap;
+    size_t size;
+    size_t cap;
+    size_t peak;
+    uint32_t next;
+};
+
+int ordered = 0;
+struct reorder reorder = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0};
+atomic_int stageLogs;
+
+void spin_work(int n) {
+    for (volatile int i = 0; i < n; i++) {
+    }
+}
+
+void parse_stage(struct stage *s, struct product *p) {
+    spin_work(s->work);
+    p->value = (p->seq * 2654435761u) % 1000;
+}
+
+void transform_stage(struct stage *s, struct product *p) {
+    spin_work(s->work);
+    p->value = p->value * p->value % 1000;
+}
+
+void aggregate_stage(struct stage *s, struct product *p) {
+    spin_work(s->work);
+    atomic_fetch_add_explicit(&s->sum, p->value, memory_order_relaxed);
+}
+
+void sink_stage(struct stage *s, struct product *p) {
+    spin_work(s->work);
+    if (ordered && p->seq != reorder.next) {
+        fprintf(stderr, "pipeline: item %u out of order\n", p->seq);
+        abort();
+    }
+    atomic_fetch_add_explicit(&s->sum, p->value, memory_order_relaxed);
+    if (log_self)
+        log_event(EV_SINK, p->seq, p->value);
+}
+
+// Min-heap on seq; items leave the heap only once every earlier seq has.
+void reorder_push(struct product p) {
+    struct reorder *r = &reorder;
+    if (r->size == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 64;
+        r->heap = realloc(r->heap, sizeof(struct product) * r->cap);
+    }
+    size_t i = r->size++;
+    while (i > 0 && r->heap[(i - 1) / 2].seq > p.seq) {
+        r->heap[i] = r->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    r->heap[i] = p;
+    if (r->size > r->peak)
+        r->peak = r->size;
+}
+
+struct product reorder_pop(void) {
+    struct reorder *r = &reorder;
+    struct product top = r->heap[0], last = r->heap[--r->size];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= r->size)
+            break;
+        if (c + 1 < r->size && r->heap[c + 1].seq < r->heap[c].seq)
+            c++;
+        if (r->heap[c].seq >= last.seq)
+            break;
+        r->heap[i] = r->heap[c];
+        i = c;
+    }
+    r->heap[i] = last;
+    return top;
+}
+
+void deliver(struct stage *s, struct product *p) {
+    if (!ordered) {
+        s->fn(s, p);
+        return;
+    }
+    pthread_mutex_lock(&reorder.mutex);
+    reorder_push(*p);
+    while (reorder.size > 0 && reorder.heap[0].seq == reorder.next) {
+        struct product q = reorder_pop();
+        s->fn(s, &q);
+        reorder.next++;
+    }
+    pthread_mutex_unlock(&reorder.mutex);
+}
+
+void *stage_thread(void *arg) {
+    struct stage *s = arg;
+    long items = 0, in_stall = 0, out_stall = 0, depth_sum = 0, depth_max = 0;
+    // under -o the reorder mutex serialises the last stage, so its threads
+    // share ring 0 and the sink lines come out in seq order
+    if (!quiet)
+        log_self = &logs[ordered && s->out == NULL
+                             ? 0
+                             : atomic_fetch_add(&stageLogs, 1)];
+    for (;;) {
+        struct product p;
+        if (s->in == NULL) {
+            p.seq = atomic_fetch_add(&s->source, 1);
+            if (p.seq >= (uint32_t)nItems)
+                break;
+            p.stamp = 0;
+        } else {
+            long depth =
+                atomic_load_explicit(&s->in->head, memory_order_relaxed) -
+                atomic_load_explicit(&s->in->tail, memory_order_relaxed);
+            depth_sum += depth;
+            if (depth > depth_max)
+                depth_max = depth;
+            if (ring_try_get(s->in, &p)) {
+                notify(&s->in->not_full, 0);
+            } else {
+                uint64_t t0 = now_ns();
+                ring_pop(s->in, &p);
+                in_stall += now_ns() - t0;
+            }
+            if (p.seq == EOS)
+                break;
+        }
+        if (s->out == NULL) {
+            deliver(s, &p);
+        } else {
+            s->fn(s, &p);
+            if (ring_try_put(s->out, p)) {
+                notify(&s->out->not_empty, 0);
+            } else {
+                uint64_t t0 = now_ns();
+                ring_push(s->out, p);
+                out_stall += now_ns() - t0;
+            }
+        }
+        items++;
+    }
+    atomic_fetch_add(&s->items, items);
+    atomic_fetch_add(&s->in_stall, in_stall);
+    atomic_fetch_add(&s->out_stall, out_stall);
+    atomic_fetch_add(&s->depth_sum, depth_sum);
+    long max = atomic_load(&s->depth_max);
+    while (depth_max > max &&
+           !atomic_compare_exchange_weak(&s->depth_max, &max, depth_max)) {
+    }
+    if (atomic_fetch_sub(&s->active, 1) == 1 && s->out) {
+        struct product eos = {0, EOS, 0};
+        for (int i = 0; i < s->next->threads; i++) {
+            ring_push(s->out, eos);
+        }
+    }
+    return NULL;
+}
+
+int parse_list(const char *arg, int *out, int n) {
+    int k = 0;
+    while (k < n) {
+        char *end;
+        out[k++] = strtol(arg, &end, 10);
+        if (*end != ',')
+            return *end == '\0' ? k : -1;
+        arg = end + 1;
+    }
+    return -1;
+}
+
+int pipeline_run(struct stage *stages, int n, size_t capacity) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        if (stages[i].threads <= 0) {
+            fprintf(stderr, "every stage needs at least one thread\n");
+            return 2;
+        }
+        total += stages[i].threads;
+    }
+    struct ring *rings = NULL;
+    if (n > 1)
+        rings = aligned_alloc(CACHE_LINE, sizeof(struct ring) * (n - 1));
+    for (int i = 0; i < n; i++) {
+        atomic_init(&stages[i].active, stages[i].threads);
+        if (i > 0)
+            stages[i].in = &rings[i - 1];
+        if (i < n - 1) {
+            ring_init(&rings[i], capacity);
+            stages[i].out = &rings[i];
+            stages[i].next = &stages[i + 1];
+        }
+    }
+    reorder.size = 0;
+    reorder.peak = 0;
+    reorder.next = 0;
+    if (!quiet) {
+        atomic_store(&stageLogs, 1);
+        log_start(total + 1);
+    }
+
+    uint64_t begin = now_ns();
+    pthread_t *ths = malloc(sizeof(pthread_t) * total);
+    for (int i = 0, t = 0; i < n; i++) {
+        for (int j = 0; j < stages[i].threads; j++, t++) {
+            int err = pthread_create(ths + t, NULL, stage_thread, &stages[i]);
+            if (err != 0) {
+                fprintf(stderr, "pthread_create error: %s\n", strerror(err));
+                return 3;
+            }
+        }
+    }
+    for (int t = 0; t < total; t++) {
+        pthread_join(ths[t], NULL);
+    }
+    double secs = (now_ns() - begin) / 1e9;
+    if (!quiet)
+        log_stop();
+
+    printf("%-10s %7s %9s %12s %10s %10s %9s %9s\n", "stage", "threads",
+           "items", "items/sec", "in_wait_s", "out_wait_s", "depth_avg",
+           "depth_max");
+    int slowest = 0;
+    double least = 2;
+    for (int i = 0; i < n; i++) {
+        struct stage *s = &stages[i];
+        long items = atomic_load(&s->items);
+        double in = atomic_load(&s->in_stall) / 1e9;
+        double out = atomic_load(&s->out_stall) / 1e9;
+        printf("%-10s %7d %9ld %12.0f %10.3f %10.3f %9.1f %9ld\n", s->name,
+               s->threads, items, items / secs, in, out,
+               items ? (double)atomic_load(&s->depth_sum) / items : 0.0,
+               atomic_load(&s->depth_max));
+        double stalled = (in + out) / (s->threads * secs);
+        if (stalled < least) {
+            least = stalled;
+            slowest = i;
+        }
+    }
+    printf("bottleneck: %s (stalled %.0f%% of its thread time), %.3f s\n",
+           stages[slowest].name, 100 * least, secs);
+
+    free(reorder.heap);
+    reorder.heap = NULL;
+    reorder.cap = 0;
+    free(ths);
+    free(rings);
+    return 0;
+}
+
+// The command-line pipeline: four fixed stages, thread counts and spin
+// work per stage given on the command line.
+#define DEMO_STAGES 4
+
+int pipeline(int argc, char **argv) {
+    const char *usage =
+        "usage: ./lab1 pipeline parse,transform,aggregate,sink [-c capacity] "
+        "[-n items] [-k work,work,work,work] [-o] [-w spin|yield|park|block] "
+        "[-s]\n";
+    struct stage stages[DEMO_STAGES] = {
+        {.name = "parse", .fn = parse_stage},
+        {.name = "transform", .fn = transform_stage},
+        {.name = "aggregate", .fn = aggregate_stage},
+        {.name = "sink", .fn = sink_stage},
+    };
+    int threads[DEMO_STAGES], work[DEMO_STAGES] = {0, 0, 0, 0};
+    size_t capacity = 1024;
+    nItems = 100000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:k:ow:s")) != -1) {
+        switch (opt) {
+        case 'c':
+            capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            nItems = atoi(optarg);
+            break;
+        case 'k':
+            if (parse_list(optarg, work, DEMO_STAGES) != DEMO_STAGES) {
+                fprintf(stderr, "-k needs %d comma-separated counts\n",
+                        DEMO_STAGES);
+                return 1;
+            }
+            break;
+        case 'o':
+            ordered = 1;
+            break;
+        case 'w':
+            strategy = -1;
+            for (int i = 0; i <= WAIT_BLOCK; i++) {
+                if (strcmp(optarg, strategies[i]) == 0)
+                    strategy = i;
+            }
+            if (strategy < 0) {
+                fprintf(stderr, "unknown wait strategy %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            quiet = 1;
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+    if (argc - optind != 1 ||
+        parse_list(argv[optind], threads, DEMO_STAGES) != DEMO_STAGES) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    if (capacity == 0 || nItems < 0) {
+        fprintf(stderr, "capacity and items must be positive\n");
+        return 2;
+    }
+    for (int i = 0; i < DEMO_STAGES; i++) {
+        stages[i].threads = threads[i];
+        stages[i].work = work[i];
+    }
+
+    int err = pipeline_run(stages, DEMO_STAGES, capacity);
+    if (err != 0)
+        return err;
+    printf("aggregate sum %ld, sink sum %ld", atomic_load(&stages[2].sum),
+           atomic_load(&stages[3].sum));
+    if (ordered)
+        printf(", reorder peak %zu", reorder.peak);
+    printf("\n");
+    return 0;
+}
+
+// Shared-memory mode: the ring, its futex words and a table of attached
+// processes live in one mapping, so producers write products straight
+// into cells that consumers in another process read. Named segments come
+// from shm_open and are attached by name; the benchmark shares a memfd
+// with forked children. Every process runs a monitor that marks peers
+// whose pid has vanished as dead, so when every process on one side has
+// died the other side stops instead of blocking forever.
+//
+// That is the only crash this recovers from. A process killed between
+// claiming a cell and publishing it leaves that cell stuck: behind an
+// unpublished cell consumers see an empty ring, and behind an unreleased
+// one producers see a full ring. If a peer on the dead process's side
+// is still running, live never drops to zero and both sides hang.
+// Recovering would mean recording each process's claimed position in its
+// peer slot and skipping it once the owner is found dead.
+#define SHM_MAGIC 0x70616331
+#define SHM_PEERS 64
+
+enum { PEER_FREE, PEER_ACTIVE, PEER_DONE, PEER_DEAD };
+
+const char *roles[] = {"producer", "consumer"};
+
+struct shm_peer {
+    atomic_int pid;
+    int role;
+    atomic_int state;
+};
+
+struct shm_header {
+    atomic_uint magic;
+    atomic_int producers;
+    atomic_int attached;
+    atomic_int ids[2];
+    atomic_long items[2];
+    struct shm_peer peers[SHM_PEERS];
+    struct ring ring;
+};
+
+struct shm_monitor {
+    int role;
+    atomic_int done;
+};
+
+struct shm_header *shm;
+size_t shmBytes;
+const char *shmName;
+
+void shm_put(struct product product) { ring_push(&shm->ring, product); }
+
+int shm_get(struct product *product) { return ring_pop(&shm->ring, product); }
+
+void shm_put_batch(const struct product *products, int n) {
+    for (int i = 0; i < n; i++) {
+        shm_put(products[i]);
+    }
+}
+
+// Cells are claimed one at a time: a producer killed between taking a
+// slot and publishing it would leave a block claim spinning forever.
+int shm_get_batch(struct product *products, int max) {
+    if (!shm_get(products))
+        return 0;
+    int k = 1;
+    while (k < max && ring_try_get(&shm->ring, products + k))
+        k++;
+    if (k > 1)
+        notify(&shm->ring.not_full, 0);
+    return k;
+}
+
+const struct queue_ops shm_ops = {"shm", shm_put, shm_get, shm_put_batch,
+                                  shm_get_batch};
+
+// The creator sizes and initialises the segment and publishes the magic
+// number last; anyone attaching waits up to five seconds for it, then
+// raises the expected producer count to its own -P if that is larger.
+int shm_map(int fd, size_t capacity, int create, int producers) {
+    size_t size = ring_size(capacity);
+    struct stat st;
+    if (create) {
+        shmBytes = sizeof(struct shm_header) + sizeof(struct cell) * size;
+        if (ftruncate(fd, shmBytes) != 0)
+            return -1;
+    } else {
+        for (int i = 0;; i++) {
+            if (fstat(fd, &st) != 0)
+                return -1;
+            if (st.st_size > 0)
+                break;
+            if (i == 5000) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            usleep(1000);
+        }
+        shmBytes = st.st_size;
+    }
+    shm = mmap(NULL, shmBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+        return -1;
+    if (create) {
+        atomic_init(&shm->producers, producers);
+        ring_setup(&shm->ring, size, (struct cell *)(shm + 1));
+        shm->ring.not_full.shared = 1;
+        shm->ring.not_empty.shared = 1;
+        atomic_store(&shm->magic, SHM_MAGIC);
+        return 0;
+    }
+    for (int i = 0; atomic_load(&shm->magic) != SHM_MAGIC; i++) {
+        if (i == 5000) {
+            munmap(shm, shmBytes);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        usleep(1000);
+    }
+    // consumers wait for the largest producer count any attacher expects
+    int expect = atomic_load(&shm->producers);
+    while (expect < producers &&
+           !atomic_compare_exchange_weak(&shm->producers, &expect, producers))
+        ;
+    return 0;
+}
+
+int peer_alive(struct shm_peer *p) {
+    return kill(atomic_load(&p->pid), 0) == 0 || errno != ESRCH;
+}
+
+// A leftover segment from a crashed run has a dead peer and nobody left
+// running. Producers that finished normally may leave items for a
+// consumer that has not attached yet; that segment is not stale.
+int shm_stale(void) {
+    int dead = 0;
+    for (int i = 0; i < SHM_PEERS; i++) {
+        struct shm_peer *p = &shm->peers[i];
+        int state = atomic_load(&p->state);
+        if (state == PEER_FREE)
+            continue;
+        if (state == PEER_ACTIVE && peer_alive(p))
+            return 0;
+        dead += state != PEER_DONE;
+    }
+    return dead > 0;
+}
+
+struct shm_peer *shm_register(int role) {
+    int pid = getpid();
+    for (int i = 0; i < SHM_PEERS; i++) {
+        struct shm_peer *p = &shm->peers[i];
+        int expect = 0;
+        if (atomic_compare_exchange_strong(&p->pid, &expect, pid)) {
+            p->role = role;
+            atomic_fetch_add(&shm->attached, 1);
+            atomic_store(&p->state, PEER_ACTIVE);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// The last process out removes the name, unless it is a producer leaving
+// undelivered items behind.
+void shm_detach(int role) {
+    size_t head = atomic_load(&shm->ring.head);
+    int pending = head != atomic_load(&shm->ring.tail);
+    if (atomic_fetch_sub(&shm->attached, 1) == 1 && shmName &&
+        (role == 1 || !pending))
+        shm_unlink(shmName);
+    munmap(shm, shmBytes);
+}
+
+// Consumers stop once every expected producer has finished or died;
+// producers stop if every consumer that attached has died.
+int shm_should_stop(int role) {
+    int seen = 0, live = 0;
+    for (int i = 0; i < SHM_PEERS; i++) {
+        struct shm_peer *p = &shm->peers[i];
+        int state = atomic_load(&p->state);
+        if (state == PEER_FREE)
+            continue;
+        if (state == PEER_ACTIVE && !peer_alive(p)) {
+            if (atomic_compare_exchange_strong(&p->state, &state,
+                                               PEER_DEAD)) {
+                fprintf(stderr, "shm: %s process %d died\n", roles[p->role],
+                        atomic_load(&p->pid));
+                atomic_fetch_sub(&shm->attached, 1);
+            }
+            state = PEER_DEAD;
+        }
+        if (p->role == role)
+            continue;
+        seen++;
+        live += state == PEER_ACTIVE;
+    }
+    if (role == 1)
+        return seen >= atomic_load(&shm->producers) && live == 0;
+    return seen > 0 && live == 0;
+}
+
+void *shm_watch(void *arg) {
+    struct shm_monitor *m = arg;
+    struct timespec nap = {0, 1000000};
+    while (!atomic_load(&m->done)) {
+        if (shm_should_stop(m->role)) {
+            atomic_store(&stopping, 1);
+            notify(&shm->ring.not_empty, 1);
+            notify(&shm->ring.not_full, 1);
+            break;
+        }
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+long shm_run(int role, int n) {
+    struct shm_peer *me = shm_register(role);
+    if (me == NULL) {
+        fprintf(stderr, "shm: more than %d processes attached\n", SHM_PEERS);
+        return -1;
+    }
+    int base = atomic_fetch_add(&shm->ids[role], n);
+    if (!quiet)
+        log_start(n);
+    struct shm_monitor m = {role, 0};
+    pthread_t watcher;
+    pthread_create(&watcher, NULL, shm_watch, &m);
+
+    pthread_t *ths = malloc(sizeof(pthread_t) * n);
+    for (int i = 0; i < n; i++) {
+        struct th_info *info = malloc(sizeof(struct th_info));
+        info->id = base + i;
+        info->cpu = -1;
+        info->log = quiet ? NULL : &logs[i];
+        int err = pthread_create(ths + i, NULL, role ? consumer : producer,
+                                 info);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create error: %s\n", strerror(err));
+            exit(3);
+        }
+    }
+    long items = 0;
+    for (int i = 0; i < n; i++) {
+        struct th_stats *st;
+        pthread_join(ths[i], (void **)&st);
+        items += st->items;
+        free(st);
+    }
+    free(ths);
+    atomic_store(&me->state, PEER_DONE);
+    atomic_store(&m.done, 1);
+    pthread_join(watcher, NULL);
+    if (!quiet)
+        log_stop();
+    atomic_fetch_add(&shm->items[role], items);
+    return items;
+}
+
+struct shm_job {
+    int role;
+    int threads;
+};
+
+void *shm_job(void *arg) {
+    struct shm_job *job = arg;
+    shm_run(job->role, job->threads);
     return NULL;
 }
 
+// Runs the same producer/consumer split once as two forked processes and
+// once as two thread groups in this process, each over a fresh memfd.
+int shm_bench(int nProducers, int nConsumers, size_t capacity) {
+    const char *modes[] = {"processes", "threads"};
+    quiet = 1;
+    for (int mode = 0; mode < 2; mode++) {
+        int fd = memfd_create("pac", 0);
+        if (fd < 0 || shm_map(fd, capacity, 1, 1) != 0) {
+            fprintf(stderr, "shm: %s\n", strerror(errno));
+            return 3;
+        }
+        close(fd);
+        atomic_store(&stopping, 0);
+        struct shm_job jobs[2] = {{0, nProducers}, {1, nConsumers}};
+        uint64_t begin = now_ns();
+        if (mode == 0) {
+            pid_t kids[2];
+            for (int role = 0; role < 2; role++) {
+                kids[role] = fork();
+                if (kids[role] == 0)
+                    _exit(shm_run(role, jobs[role].threads) < 0);
+            }
+            for (int role = 0; role < 2; role++) {
+                int status;
+                waitpid(kids[role], &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    fprintf(stderr, "shm: %s process failed\n", roles[role]);
+            }
+        } else {
+            pthread_t ths[2];
+            for (int role = 0; role < 2; role++) {
+                pthread_create(&ths[role], NULL, shm_job, &jobs[role]);
+            }
+            for (int role = 0; role < 2; role++) {
+                pthread_join(ths[role], NULL);
+            }
+        }
+        double secs = (now_ns() - begin) / 1e9;
+        long consumed = atomic_load(&shm->items[1]);
+        printf("shm %s: %d producers %d consumers %ld items in %.3f s, %.0f "
+               "items/sec\n",
+               modes[mode], nProducers, nConsumers, consumed, secs,
+               consumed / secs);
+        munmap(shm, shmBytes);
+    }
+    return 0;
+}
+
+int shm_main(int argc, char **argv) {
+    const char *usage =
+        "usage: ./lab1 shm produce|consume name threads [-n items] "
+        "[-c capacity] [-b batch] [-P producers] [-w spin|yield|park] [-s]\n"
+        "       ./lab1 shm bench nProducers nConsumers [-n items] "
+        "[-c capacity] [-b batch] [-w spin|yield|park]\n";
+    size_t capacity = 1024;
+    int producers = 1;
+    nItems = 100000;
+    queue = &shm_ops;
+    strategy = WAIT_PARK;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:b:P:w:s")) != -1) {
+        switch (opt) {
+        case 'n':
+            nItems = atoi(optarg);
+            break;
+        case 'c':
+            capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'P':
+            producers = atoi(optarg);
+            break;
+        case 'w':
+            strategy = -1;
+            for (int i = 0; i < WAIT_BLOCK; i++) {
+                if (strcmp(optarg, strategies[i]) == 0)
+                    strategy = i;
+            }
+            if (strategy < 0) {
+                fprintf(stderr, "unknown wait strategy %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            quiet = 1;
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    if (capacity == 0 || nItems < 0 || batch <= 0 || producers <= 0) {
+        fprintf(stderr, "capacity, items, batch and producers must be "
+                        "positive\n");
+        return 2;
+    }
+    if (strcmp(argv[optind], "bench") == 0) {
+        int nProducers = atoi(argv[optind + 1]);
+        int nConsumers = atoi(argv[optind + 2]);
+        if (!(nProducers > 0 && nConsumers > 0)) {
+            fprintf(stderr,
+                    "nProducers and nConsumers must be greater than zero\n");
+            return 2;
+        }
+        return shm_bench(nProducers, nConsumers, capacity);
+    }
+
+    const char *verbs[] = {"produce", "consume"};
+    int role = -1;
+    for (int i = 0; i < 2; i++) {
+        if (strcmp(argv[optind], verbs[i]) == 0)
+            role = i;
+    }
+    int threads = atoi(argv[optind + 2]);
+    if (role < 0 || threads <= 0) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    shmName = argv[optind + 1];
+    for (int tries = 0;; tries++) {
+        int fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+        int create = fd >= 0;
+        if (fd < 0 && errno == EEXIST)
+            fd = shm_open(shmName, O_RDWR, 0);
+        if (fd < 0 || shm_map(fd, capacity, create, producers) != 0) {
+            fprintf(stderr, "shm %s: %s\n", shmName, strerror(errno));
+            return 3;
+        }
+        close(fd);
+        if (create || tries > 0 || !shm_stale())
+            break;
+        fprintf(stderr, "shm %s: replacing stale segment\n", shmName);
+        shm_unlink(shmName);
+        munmap(shm, shmBytes);
+    }
+
+    uint64_t begin = now_ns();
+    long items = shm_run(role, threads);
+    double secs = (now_ns() - begin) / 1e9;
+    if (items >= 0 && quiet)
+        printf("shm %s: %d threads %ld items in %.3f s, %.0f items/sec\n",
+               roles[role], threads, items, secs, items / secs);
+    shm_detach(role);
+    return items < 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "usage: ./lab1 nProducers nConsumers\n");
+    const char *usage =
+        "usage: ./lab1 nProducers nConsumers [-q slot|ring|shard|msg] "
+        "[-c capacity] [-m maxlen] [-n items] [-b batch] "
+        "[-w spin|yield|park|block] "
+        "[-a none|compact|scatter|pair|cpu,cpu,...] [-l log-events] "
+        "[-r seed] [-s] [-B [-d seconds] [-H]]\n";
+    size_t capacity = 1024;
+    double duration = 0;
+    int header = 0, limited = 0;
+    queue = &queues[0];
+
+    if (argc > 1 && strcmp(argv[1], "pipeline") == 0)
+        return pipeline(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "shm") == 0)
+        return shm_main(argc - 1, argv + 1);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "q:c:m:n:b:w:a:l:r:sBd:H")) != -1) {
+        switch (opt) {
+        case 'q':
+            queue = NULL;
+            for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+                if (strcmp(optarg, queues[i].name) == 0)
+                    queue = &queues[i];
+            }
+            if (queue == NULL) {
+                fprintf(stderr, "unknown queue %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            maxLen = atoi(optarg);
+            break;
+        case 'n':
+            nItems = atoi(optarg);
+            limited = 1;
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'w':
+            strategy = -1;
+            for (int i = 0; i <= WAIT_BLOCK; i++) {
+                if (strcmp(optarg, strategies[i]) == 0)
+                    strategy = i;
+            }
+            if (strategy < 0) {
+                fprintf(stderr, "unknown wait strategy %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            placement = -1;
+            for (int i = PLACE_NONE; i < PLACE_LIST; i++) {
+                if (strcmp(optarg, placements[i]) == 0)
+                    placement = i;
+            }
+            if (placement < 0) {
+                nCpuList = parse_list(optarg, cpuList, CPU_SETSIZE);
+                if (nCpuList <= 0) {
+                    fprintf(stderr, "unknown placement %s\n", optarg);
+                    return 1;
+                }
+                placement = PLACE_LIST;
+            }
+            break;
+        case 'l':
+            logSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            quiet = 1;
+            break;
+        case 'B':
+            bench = quiet = 1;
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'H':
+            header = 1;
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "%s", usage);
         return 1;
     }
 
-    int nProducers = atoi(argv[1]);
-    int nConsumers = atoi(argv[2]);
+    int nProducers = atoi(argv[optind]);
+    int nConsumers = atoi(argv[optind + 1]);
 
     if (!(nProducers > 0 && nConsumers > 0)) {
         fprintf(stderr,
@@ -75,13 +2062,44 @@ int main(int argc, char **argv) {
         return 2;
     }
 
-    pthread_t *ths = malloc(sizeof(pthread_t) * nProducers);
+    if (capacity == 0 || nItems < 0 || batch <= 0 || duration < 0 ||
+        maxLen < 0 || logSize == 0) {
+        fprintf(stderr, "capacity, items and batch must be positive\n");
+        return 2;
+    }
+    // the single slot always waits on its own mutex/condvar
+    if (queue->put == slot_put)
+        strategy = WAIT_BLOCK;
+    if (queue->put == shard_put)
+        shards_init(nProducers, nConsumers, capacity);
+    else if (queue->put == msg_put)
+        msgq_init(&msgq, capacity, maxLen);
+    else
+        ring_init(&ring, capacity);
+
+    if (placement != PLACE_NONE)
+        topology_init();
+    if (!quiet)
+        log_start(nProducers + nConsumers);
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    uint64_t begin = now_ns();
+    if (duration > 0) {
+        deadline = begin + (uint64_t)(duration * 1e9);
+        if (!limited)
+            nItems = INT_MAX;
+    }
+
+    pthread_t *ths = malloc(sizeof(pthread_t) * (nProducers + nConsumers));
     for (int i = 0; i < nProducers; i++) {
         struct th_info *info = malloc(sizeof(struct th_info));
         info->id = i;
+        info->cpu = cpu_for(0, i, nProducers);
+        info->log = quiet ? NULL : &logs[i];
         int err = pthread_create(ths + i, NULL, producer, info);
-        if (err < 0) {
-            fprintf(stderr, "pthread_create error: %s\n", strerror(errno));
+        if (err != 0) {
+            fprintf(stderr, "pthread_create error: %s\n", strerror(err));
             return 3;
         }
     }
@@ -89,17 +2107,41 @@ int main(int argc, char **argv) {
     for (int i = 0; i < nConsumers; i++) {
         struct th_info *info = malloc(sizeof(struct th_info));
         info->id = i;
-        pthread_t th;
-        int err = pthread_create(&th, NULL, consumer, info);
-        if (err < 0) {
-            fprintf(stderr, "pthread_create error: %s\n", strerror(errno));
+        info->cpu = cpu_for(1, i, nProducers);
+        info->log = quiet ? NULL : &logs[nProducers + i];
+        int err = pthread_create(ths + nProducers + i, NULL, consumer, info);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create error: %s\n", strerror(err));
             return 4;
         }
     }
 
-    for (int i = 0; i < nProducers; i++) {
-        pthread_join(ths[i], NULL);
+    long produced = 0, consumed = 0;
+    long *hist = calloc(NBUCKETS, sizeof(long));
+    for (int i = 0; i < nProducers + nConsumers; i++) {
+        if (i == nProducers)
+            stop_queues();
+        struct th_stats *st;
+        pthread_join(ths[i], (void **)&st);
+        if (i < nProducers) {
+            produced += st->items;
+        } else {
+            consumed += st->items;
+            for (int b = 0; b < NBUCKETS; b++) {
+                hist[b] += st->hist[b];
+            }
+        }
+        free(st);
     }
 
+    if (!quiet)
+        log_stop();
+    double secs = (now_ns() - begin) / 1e9;
+    getrusage(RUSAGE_SELF, &ru1);
+    if (quiet)
+        report(nProducers, nConsumers, capacity, produced, consumed, hist,
+               secs, &ru0, &ru1, header);
+
+    free(hist);
     free(ths);
 }